@@ -0,0 +1,53 @@
+#!/bin/bash
+# Round trip of packing: generated files are packed into lod archive, extracted, packed again and extracted again.
+# Extracted files must be identical to original ones, and archive packed from extracted files must be identical to first one
+# usage: pack_roundtrip.sh path/to/vcmiextract
+set -euo pipefail
+
+tool=$(realpath "$1")
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+mkdir -p "$work/source/DATA"
+
+# compressible and incompressible files, empty file, and animations that are extracted as they are with --raw-animations.
+# Damaged animation is also extracted as it is without --raw-animations, and must not stop extraction of other files
+seq 1 100000 > "$work/source/DATA/NUMBERS.TXT"
+head -c 100000 /dev/urandom > "$work/source/DATA/RANDOM.BIN"
+head -c 5000 /dev/urandom > "$work/source/DATA/SPRITE.DEF"
+echo "damaged animation" > "$work/source/DATA/DAMAGED.DEF"
+: > "$work/source/DATA/EMPTY.TXT"
+
+for options in "" "--store-incompressible"; do
+	echo "round trip with options '$options'"
+	rm -rf "$work/source/DATA.lod" "$work/first" "$work/second"
+	mkdir "$work/first" "$work/second"
+
+	"$tool" $options --pack "$work/source/DATA"
+
+	# existing archive is never replaced without --force
+	cp "$work/source/DATA.lod" "$work/first/DATA.lod"
+	: > "$work/source/DATA.lod"
+	"$tool" $options --pack "$work/source/DATA"
+	test ! -s "$work/source/DATA.lod"
+	"$tool" $options --force --pack "$work/source/DATA"
+	cmp "$work/source/DATA.lod" "$work/first/DATA.lod"
+
+	"$tool" --raw-animations "$work/first/DATA.lod"
+	diff -r "$work/source/DATA" "$work/first/DATA"
+
+	rm "$work/first/DATA.lod"
+	"$tool" $options --pack "$work/first/DATA"
+	cmp "$work/source/DATA.lod" "$work/first/DATA.lod"
+
+	mv "$work/first/DATA.lod" "$work/second/DATA.lod"
+	"$tool" --raw-animations "$work/second/DATA.lod"
+	diff -r "$work/source/DATA" "$work/second/DATA"
+
+	rm -rf "$work/second/DATA"
+	"$tool" "$work/second/DATA.lod"
+	cmp "$work/source/DATA/DAMAGED.DEF" "$work/second/DATA/DAMAGED.DEF"
+	cmp "$work/source/DATA/NUMBERS.TXT" "$work/second/DATA/NUMBERS.TXT"
+done
+
+echo "round trip passed"
@@ -1,6 +1,8 @@
 #include "file_format_dds.h"
 
-#include <array>
+#include "kernels.h"
+
+#include <vector>
 
 enum dds_header_flags : uint32_t
 {
@@ -71,131 +73,34 @@ struct dds_header
 	uint32_t reserved2;
 };
 
-struct color_dxt
-{
-	uint16_t r = 0;
-	uint16_t g = 0;
-	uint16_t b = 0;
-
-	color_dxt() = default;
-
-	explicit color_dxt(uint16_t r, uint16_t g, uint16_t b)
-		: r(r)
-		, g(g)
-		, b(b)
-	{
-	}
-
-	explicit color_dxt(uint16_t value)
-		: r(((value) & 31) << 3)
-		, g(((value >> 5) & 63) << 2)
-		, b(((value >> 11)) << 3)
-	{
-		assert(r < 256);
-		assert(g < 256);
-		assert(b < 256);
-	}
-
-	color_dxt operator+(const color_dxt & other) const
-	{
-		return color_dxt(r + other.r, g + other.g, b + other.b);
-	}
-
-	color_dxt operator/(uint16_t other) const
-	{
-		return color_dxt(r / other, g / other, b / other);
-	}
-
-	color_dxt operator*(uint16_t other) const
-	{
-		return color_dxt(r * other, g * other, b * other);
-	}
-};
-
-std::array<color_dxt, 4> load_dxt_color_block(memory_file & data)
-{
-	std::array<color_dxt, 4> colors;
-
-	uint16_t color0 = data.read<uint16_t>();
-	uint16_t color1 = data.read<uint16_t>();
-
-	colors[0] = color_dxt(color0);
-	colors[1] = color_dxt(color1);
-
-	if(color0 > color1)
-	{
-		colors[2] = colors[0] * 2 / 3 + colors[1] / 3;
-		colors[3] = colors[0] / 3 + colors[1] * 2 / 3;
-	}
-	else
-	{
-		colors[2] = colors[0] / 2 + colors[1] / 2;
-		colors[3] = color_dxt(0); // black
-	}
-	return colors;
-}
-
-std::array<uint8_t, 8> load_dxt_alpha_block(memory_file & data)
-{
-	std::array<uint8_t, 8> alpha;
-
-	alpha[0] = data.read<uint8_t>();
-	alpha[1] = data.read<uint8_t>();
-
-	if(alpha[0] > alpha[1])
-	{
-		alpha[2] = (alpha[0] * 6 + alpha[1] * 1) / 7;
-		alpha[3] = (alpha[0] * 5 + alpha[1] * 2) / 7;
-		alpha[4] = (alpha[0] * 4 + alpha[1] * 3) / 7;
-		alpha[5] = (alpha[0] * 3 + alpha[1] * 4) / 7;
-		alpha[6] = (alpha[0] * 2 + alpha[1] * 5) / 7;
-		alpha[7] = (alpha[0] * 1 + alpha[1] * 6) / 7;
-	}
-	else
-	{
-		alpha[2] = (alpha[0] * 4 + alpha[1] * 1) / 5;
-		alpha[3] = (alpha[0] * 3 + alpha[1] * 2) / 5;
-		alpha[4] = (alpha[0] * 2 + alpha[1] * 3) / 5;
-		alpha[5] = (alpha[0] * 1 + alpha[1] * 4) / 5;
-		alpha[6] = 0;
-		alpha[7] = 255;
-	}
-	return alpha;
-}
-
 static basic_image_ptr load_dxt1(const dds_header & header, memory_file & data)
 {
 	const uint32_t block_width = 4;
 	const uint32_t block_height = 4;
 	const uint32_t block_area = block_width * block_height;
+	const uint32_t block_size = 8;
 
-	assert(header.image_height % block_area == 0);
-	assert(header.image_width % block_area == 0);
+	CHECK_FORMAT(header.image_height % block_area == 0);
+	CHECK_FORMAT(header.image_width % block_area == 0);
 
 	auto image = std::make_shared<basic_image>(header.image_height, header.image_width, header.image_width * 3, basic_image::image_format::rgb24);
 
+	const auto & kernel = kernels::active();
+	uint32_t blocks_count = header.image_width / block_width;
+	size_t stride = size_t(header.image_width) * 4;
+
+	// every row of blocks is decoded into rgba32 rows, which are then repacked into image
+	std::vector<uint8_t> rows(stride * block_height);
+
 	for(uint32_t by = 0; by < header.image_height; by += block_height)
 	{
-		for(uint32_t bx = 0; bx < header.image_width; bx += block_height)
-		{
-			std::array<color_dxt, 4> colors = load_dxt_color_block(data);
-			uint32_t lookup_table = data.read<uint32_t>();
-
-			for(uint32_t y = 0; y < block_height; ++y)
-			{
-				for(uint32_t x = 0; x < block_width; ++x)
-				{
-					int offset = (y * block_width + x) * 2;
-					int index = (lookup_table >> offset) & 0x3;
-					color_dxt c = colors[index];
-
-					auto dst = image->rgb(bx + x, by + y);
-					dst.set_red(c.r);
-					dst.set_green(c.g);
-					dst.set_blue(c.b);
-				}
-			}
-		}
+		const uint8_t * blocks = data.ptr();
+		data.skip(size_t(blocks_count) * block_size);
+
+		kernel.decode_dxt1_blocks(blocks, blocks_count, rows.data(), stride);
+
+		for(uint32_t y = 0; y < block_height; ++y)
+			kernel.repack_row_rgba_to_rgb(rows.data() + y * stride, image->rgb(0, by + y).ptr, header.image_width);
 	}
 	return image;
 }
@@ -205,47 +110,27 @@ static basic_image_ptr load_dxt5(const dds_header & header, memory_file & data)
 	const uint32_t block_width = 4;
 	const uint32_t block_height = 4;
 	const uint32_t block_area = block_width * block_height;
+	const uint32_t block_size = 16;
 
-	assert(header.image_height % block_area == 0);
-	assert(header.image_width % block_area == 0);
+	CHECK_FORMAT(header.image_height % block_area == 0);
+	CHECK_FORMAT(header.image_width % block_area == 0);
 
 	auto image = std::make_shared<basic_image>(header.image_height, header.image_width, header.image_width * 4, basic_image::image_format::rgba32);
 
+	const auto & kernel = kernels::active();
+	uint32_t blocks_count = header.image_width / block_width;
+
 	for(uint32_t by = 0; by < header.image_height; by += block_height)
 	{
-		for(uint32_t bx = 0; bx < header.image_width; bx += block_height)
-		{
-			std::array<uint8_t, 8> alphas = load_dxt_alpha_block(data);
-			uint64_t lookup_table_a = data.read<uint32_t>() + (uint64_t(data.read<uint16_t>()) << 32);
-
-			std::array<color_dxt, 4> colors = load_dxt_color_block(data);
-			uint32_t lookup_table_c = data.read<uint32_t>();
-
-			for(uint32_t y = 0; y < block_height; ++y)
-			{
-				for(uint32_t x = 0; x < block_width; ++x)
-				{
-					int offset = (y * block_width + x);
-					int offset_c = offset * 2;
-					int offset_a = offset * 3;
-					int index_c = (lookup_table_c >> offset_c) & 0x3;
-					int index_a = (lookup_table_a >> offset_a) & 0x7;
-					color_dxt c = colors[index_c];
-					uint8_t a = alphas[index_a];
-
-					auto dst = image->rgba(bx + x, by + y);
-					dst.set_red(c.r);
-					dst.set_green(c.g);
-					dst.set_blue(c.b);
-					dst.set_alpha(a);
-				}
-			}
-		}
+		const uint8_t * blocks = data.ptr();
+		data.skip(size_t(blocks_count) * block_size);
+
+		kernel.decode_dxt5_blocks(blocks, blocks_count, image->rgba(0, by).ptr, image->scanline);
 	}
 	return image;
 }
 
-basic_image_ptr file_format_dds::load(memory_file & data)
+static dds_header load_header(memory_file & data)
 {
 	uint32_t magic;
 	dds_header header;
@@ -257,37 +142,59 @@ basic_image_ptr file_format_dds::load(memory_file & data)
 	// However they don't occur in HD Edition
 	// Similarly, only DXT1 and DXT5 compressions are supported, since nothing else is needed for HD Edition
 
-	assert(magic == 0x20534444);
-	assert(header.header_size == 124);
-	assert(header.flags == (DDSD_CAPS | DDSD_HEIGHT | DDSD_WIDTH | DDSD_PIXELFORMAT | DDSD_MIPMAPCOUNT | DDSD_LINEARSIZE));
-	assert(header.depth == 0);
-	assert(header.mipMapCount == 1);
-	assert(header.caps == (DDSCAPS_COMPLEX | DDSCAPS_MIPMAP | DDSCAPS_TEXTURE));
-	assert(header.caps2 == 0);
-	assert(header.caps3 == 0);
-	assert(header.caps4 == 0);
-	assert(header.reserved2 == 0);
-
-	assert(header.pixel_format.format_size == 32);
-	assert(header.pixel_format.flags == (DDPF_ALPHAPIXELS | DDPF_FOURCC));
-	assert(header.pixel_format.format_code == DDS_FORMAT_DXT5 || header.pixel_format.format_code == DDS_FORMAT_DXT1);
-	assert(header.pixel_format.bits_count == 0);
-	assert(header.pixel_format.bitmask_r == 0);
-	assert(header.pixel_format.bitmask_g == 0);
-	assert(header.pixel_format.bitmask_b == 0);
-	assert(header.pixel_format.bitmask_a == 0);
+	CHECK_FORMAT(magic == 0x20534444);
+	CHECK_FORMAT(header.header_size == 124);
+	CHECK_FORMAT(header.flags == (DDSD_CAPS | DDSD_HEIGHT | DDSD_WIDTH | DDSD_PIXELFORMAT | DDSD_MIPMAPCOUNT | DDSD_LINEARSIZE));
+	CHECK_FORMAT(header.depth == 0);
+	CHECK_FORMAT(header.mipMapCount == 1);
+	CHECK_FORMAT(header.caps == (DDSCAPS_COMPLEX | DDSCAPS_MIPMAP | DDSCAPS_TEXTURE));
+	CHECK_FORMAT(header.caps2 == 0);
+	CHECK_FORMAT(header.caps3 == 0);
+	CHECK_FORMAT(header.caps4 == 0);
+	CHECK_FORMAT(header.reserved2 == 0);
+
+	CHECK_FORMAT(header.pixel_format.format_size == 32);
+	CHECK_FORMAT(header.pixel_format.flags == (DDPF_ALPHAPIXELS | DDPF_FOURCC));
+	CHECK_FORMAT(header.pixel_format.format_code == DDS_FORMAT_DXT5 || header.pixel_format.format_code == DDS_FORMAT_DXT1);
+	CHECK_FORMAT(header.pixel_format.bits_count == 0);
+	CHECK_FORMAT(header.pixel_format.bitmask_r == 0);
+	CHECK_FORMAT(header.pixel_format.bitmask_g == 0);
+	CHECK_FORMAT(header.pixel_format.bitmask_b == 0);
+	CHECK_FORMAT(header.pixel_format.bitmask_a == 0);
+
+	if(header.pixel_format.format_code == DDS_FORMAT_DXT5)
+		CHECK_FORMAT(header.pitchOrLinearSize == header.image_width * header.image_height);
+
+	if(header.pixel_format.format_code == DDS_FORMAT_DXT1)
+		CHECK_FORMAT(header.pitchOrLinearSize * 2 == header.image_width * header.image_height);
+
+	return header;
+}
+
+basic_image_ptr file_format_dds::load(memory_file & data)
+{
+	dds_header header = load_header(data);
 
 	if(header.pixel_format.format_code == DDS_FORMAT_DXT5)
-	{
-		assert(header.pitchOrLinearSize == header.image_width * header.image_height);
 		return load_dxt5(header, data);
-	}
 
 	if(header.pixel_format.format_code == DDS_FORMAT_DXT1)
-	{
-		assert(header.pitchOrLinearSize * 2 == header.image_width * header.image_height);
 		return load_dxt1(header, data);
-	}
 
 	return nullptr;
 }
+
+file_format_dds::compressed_texture file_format_dds::load_compressed(memory_file & data)
+{
+	dds_header header = load_header(data);
+
+	compressed_texture result;
+	result.width = header.image_width;
+	result.height = header.image_height;
+	result.format = header.pixel_format.format_code == DDS_FORMAT_DXT5 ? block_format::bc3 : block_format::bc1;
+	result.data = data.ptr();
+	result.size = header.pitchOrLinearSize;
+
+	CHECK_FORMAT(data.tell() + result.size <= data.size());
+	return result;
+}
@@ -5,5 +5,22 @@
 
 namespace file_format_dds
 {
+    enum class block_format
+    {
+        bc1, // DXT1
+        bc3, // DXT5
+    };
+
+    // block-compressed data of a texture, as it is stored in dds file
+    struct compressed_texture
+    {
+        uint32_t width = 0;
+        uint32_t height = 0;
+        block_format format = block_format::bc1;
+        const uint8_t * data = nullptr;
+        size_t size = 0;
+    };
+
     basic_image_ptr load(memory_file & data);
+    compressed_texture load_compressed(memory_file & data);
 }
@@ -0,0 +1,112 @@
+#include "file_format_ktx.h"
+
+#include <array>
+
+// Writer of KTX 2.0 container, see https://registry.khronos.org/KTX/specs/2.0/ktxspec.v2.html
+// Only single-level 2D textures without supercompression are supported, which is all that dds sheets of HD Edition contain
+
+enum ktx_vk_format : uint32_t
+{
+	VK_FORMAT_BC1_RGBA_UNORM_BLOCK = 133,
+	VK_FORMAT_BC3_UNORM_BLOCK      = 137,
+};
+
+// Values from Khronos Data Format Specification, used in data format descriptor
+enum ktx_dfd_values : uint8_t
+{
+	KHR_DF_MODEL_BC1A                = 128,
+	KHR_DF_MODEL_BC3                 = 130,
+	KHR_DF_PRIMARIES_BT709           = 1,
+	KHR_DF_TRANSFER_LINEAR           = 1,
+	KHR_DF_CHANNEL_BC1A_ALPHAPRESENT = 1,
+	KHR_DF_CHANNEL_BC3_COLOR         = 0,
+	KHR_DF_CHANNEL_BC3_ALPHA         = 15,
+};
+
+static const std::array<uint8_t, 12> ktx_identifier = { 0xab, 'K', 'T', 'X', ' ', '2', '0', 0xbb, '\r', '\n', 0x1a, '\n' };
+
+static void write_u32_le(std::vector<uint8_t> & output, uint32_t value)
+{
+	output.push_back(value >> 0);
+	output.push_back(value >> 8);
+	output.push_back(value >> 16);
+	output.push_back(value >> 24);
+}
+
+static void write_u64_le(std::vector<uint8_t> & output, uint64_t value)
+{
+	write_u32_le(output, static_cast<uint32_t>(value));
+	write_u32_le(output, static_cast<uint32_t>(value >> 32));
+}
+
+static void write_dfd_sample(std::vector<uint8_t> & output, uint8_t channel, uint16_t bit_offset, uint8_t bit_length)
+{
+	write_u32_le(output, bit_offset | ((bit_length - 1) << 16) | (channel << 24));
+	write_u32_le(output, 0); // sample position
+	write_u32_le(output, 0); // lower
+	write_u32_le(output, 0xffffffff); // upper
+}
+
+void file_format_ktx::encode_texture(const file_format_dds::compressed_texture & texture, std::vector<uint8_t> & output)
+{
+	bool is_bc3 = texture.format == file_format_dds::block_format::bc3;
+
+	uint32_t block_size = is_bc3 ? 16 : 8;
+	uint32_t samples_count = is_bc3 ? 2 : 1;
+	uint32_t descriptor_block_size = 24 + 16 * samples_count;
+	uint32_t dfd_size = 4 + descriptor_block_size;
+
+	constexpr uint32_t header_size = 12 + 9 * 4 + 4 * 4 + 2 * 8;
+	constexpr uint32_t level_index_size = 3 * 8;
+	uint32_t dfd_offset = header_size + level_index_size;
+
+	// mip level must be aligned to size of block, which is also multiple of 4
+	uint32_t level_offset = (dfd_offset + dfd_size + block_size - 1) / block_size * block_size;
+
+	size_t start = output.size();
+	output.reserve(start + level_offset + texture.size);
+
+	output.insert(output.end(), ktx_identifier.begin(), ktx_identifier.end());
+	write_u32_le(output, is_bc3 ? VK_FORMAT_BC3_UNORM_BLOCK : VK_FORMAT_BC1_RGBA_UNORM_BLOCK);
+	write_u32_le(output, 1); // type size, always 1 for block-compressed formats
+	write_u32_le(output, texture.width);
+	write_u32_le(output, texture.height);
+	write_u32_le(output, 0); // depth
+	write_u32_le(output, 0); // layers count
+	write_u32_le(output, 1); // faces count
+	write_u32_le(output, 1); // levels count
+	write_u32_le(output, 0); // supercompression scheme
+
+	write_u32_le(output, dfd_offset);
+	write_u32_le(output, dfd_size);
+	write_u32_le(output, 0); // key/value data offset
+	write_u32_le(output, 0); // key/value data size
+	write_u64_le(output, 0); // supercompression global data offset
+	write_u64_le(output, 0); // supercompression global data size
+
+	write_u64_le(output, level_offset);
+	write_u64_le(output, texture.size);
+	write_u64_le(output, texture.size); // uncompressed size
+
+	// data format descriptor, with single basic descriptor block
+	write_u32_le(output, dfd_size);
+	write_u32_le(output, 0); // vendor and descriptor type
+	write_u32_le(output, 2 | (descriptor_block_size << 16)); // version and size of descriptor block
+	write_u32_le(output, (is_bc3 ? KHR_DF_MODEL_BC3 : KHR_DF_MODEL_BC1A) | (KHR_DF_PRIMARIES_BT709 << 8) | (KHR_DF_TRANSFER_LINEAR << 16));
+	write_u32_le(output, 3 | (3 << 8)); // dimensions of 4x4 block, minus one
+	write_u32_le(output, block_size); // bytes in plane 0
+	write_u32_le(output, 0); // bytes in planes 4-7
+
+	if(is_bc3)
+	{
+		write_dfd_sample(output, KHR_DF_CHANNEL_BC3_ALPHA, 0, 64);
+		write_dfd_sample(output, KHR_DF_CHANNEL_BC3_COLOR, 64, 64);
+	}
+	else
+	{
+		write_dfd_sample(output, KHR_DF_CHANNEL_BC1A_ALPHAPRESENT, 0, 64);
+	}
+
+	output.resize(start + level_offset, 0);
+	output.insert(output.end(), texture.data, texture.data + texture.size);
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "file_format_dds.h"
+
+#include <vector>
+
+namespace file_format_ktx
+{
+	// Wraps block-compressed texture into KTX2 container. Compressed blocks are copied as they are
+	void encode_texture(file_format_dds::compressed_texture const& texture, std::vector<uint8_t> & output);
+}
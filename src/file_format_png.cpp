@@ -1,8 +1,14 @@
 #include "file_format_png.h"
 
+#include "format_error.h"
+#include "kernels.h"
+#include "parallel.h"
+
 #include <vector>
 #include <array>
 #include <algorithm>
+#include <cstring>
+#include <zlib.h>
 #if __has_include(<libpng16/png.h>)
 #include <libpng16/png.h>
 #else
@@ -17,6 +23,8 @@ static uint8_t get_bytes_per_pixel_by_format(basic_image::image_format format)
 			return 1;
 		case basic_image::image_format::g8:
 			return 1;
+		case basic_image::image_format::ga16:
+			return 2;
 		case basic_image::image_format::rgb24:
 			return 3;
 		case basic_image::image_format::rgba32:
@@ -27,7 +35,7 @@ static uint8_t get_bytes_per_pixel_by_format(basic_image::image_format format)
 	}
 }
 
-basic_image::basic_image(uint32_t height, uint32_t width, uint32_t scanline, image_format format)
+basic_image::basic_image(uint32_t height, uint32_t width, uint32_t scanline, image_format format, bool clear)
 	: pixels(new uint8_t[static_cast<size_t>(scanline) * height])
 	, scanline(scanline)
 	, height(height)
@@ -43,7 +51,8 @@ basic_image::basic_image(uint32_t height, uint32_t width, uint32_t scanline, ima
 	if(format == image_format::p8)
 		palette.reset(new uint8_t[256 * 3]);
 
-	std::fill_n(pixels.get(), scanline * height, uint8_t(0));
+	if(clear)
+		std::fill_n(pixels.get(), scanline * height, uint8_t(0));
 }
 
 basic_image basic_image::section(uint32_t left, uint32_t top, uint32_t section_width, uint32_t section_height)
@@ -70,26 +79,7 @@ basic_image basic_image::rotateCounterclockwise()
 {
 	basic_image ret(width, height, height * bytes_per_pixel, format);
 
-	constexpr uint32_t block_size = 16;
-	uint32_t width_blocks = (width + block_size - 1) / block_size;
-	uint32_t height_blocks = (height + block_size - 1) / block_size;
-
-	for (uint32_t block_x = 0; block_x < width_blocks; ++block_x)
-	{
-		for (uint32_t block_y = 0; block_y < height_blocks; ++block_y)
-		{
-			uint32_t block_x_begin = block_x * block_size;
-			uint32_t block_x_end = std::min(width, block_x_begin + block_size);
-			uint32_t block_y_begin = block_y * block_size;
-			uint32_t block_y_end = std::min(height, block_y_begin + block_size);
-
-			for (uint32_t x = block_x_begin; x < block_x_end; ++x)
-			{
-				for (uint32_t y = block_y_begin; y < block_y_end; ++y)
-					std::copy_n(get_pixel_ptr(x, y), bytes_per_pixel, ret.get_pixel_ptr(y,x));
-			}
-		}
-	}
+	kernels::active().transpose(pixels.get(), scanline, ret.pixels.get(), ret.scanline, width, height, bytes_per_pixel);
 
 	return ret;
 }
@@ -104,6 +94,9 @@ static uint8_t get_png_color_type_from_format(basic_image::image_format format)
 		case basic_image::image_format::g8:
 			return PNG_COLOR_TYPE_GRAY;
 
+		case basic_image::image_format::ga16:
+			return PNG_COLOR_TYPE_GRAY_ALPHA;
+
 		case basic_image::image_format::rgb24:
 			return PNG_COLOR_TYPE_RGB;
 
@@ -116,86 +109,891 @@ static uint8_t get_png_color_type_from_format(basic_image::image_format format)
 	return 0;
 }
 
+basic_image_ptr file_format_png::expand_palette(const basic_image_ptr & image, const uint8_t * palette_alpha)
+{
+	assert(image->format == basic_image::image_format::p8);
+
+	// pixels are stored as BGRA, palette as RGB. Translucent entries are black, so only alpha defines them
+	std::array<uint32_t, 256> lookup;
+	for(uint32_t i = 0; i < 256; ++i)
+	{
+		const uint8_t * color = image->palette.get() + i * 3;
+		uint8_t alpha = palette_alpha ? palette_alpha[i] : 0xff;
+		uint8_t pixel[4] = { color[2], color[1], color[0], alpha };
+
+		if(alpha != 0xff)
+			std::fill_n(pixel, 3, 0);
+
+		std::memcpy(&lookup[i], pixel, 4);
+	}
+
+	// every byte will be overwritten, no need to clear image
+	auto result = std::make_shared<basic_image>(image->height, image->width, image->width * 4, basic_image::image_format::rgba32, false);
+
+	for(uint32_t y = 0; y < image->height; y++)
+	{
+		const uint8_t * src = image->pixels.get() + static_cast<size_t>(image->scanline) * y;
+		uint8_t * dst = result->pixels.get() + static_cast<size_t>(result->scanline) * y;
+		kernels::active().expand_row_indexed_to_rgba(src, dst, image->width, lookup.data());
+	}
+	return result;
+}
+
 basic_image_ptr file_format_png::optimize_try_drop_alpha(const basic_image_ptr & image)
 {
 	if(image->format != basic_image::image_format::rgba32)
 		return image;
 
 	for(uint32_t y = 0; y < image->height; y++)
-		for(uint32_t x = 0; x < image->width; x++)
-			if(image->rgba(x, y).alpha() != 0xff)
-				return image;
+		if(!kernels::active().is_row_opaque(image->pixels.get() + static_cast<size_t>(image->scanline) * y, image->width))
+			return image;
+
+	// every byte will be overwritten, no need to clear image
+	auto temp_image = std::make_shared<basic_image>(image->height, image->width, image->width * 3, basic_image::image_format::rgb24, false);
+
+	for(uint32_t y = 0; y < image->height; y++)
+	{
+		const uint8_t * src = image->pixels.get() + static_cast<size_t>(image->scanline) * y;
+		uint8_t * dst = temp_image->pixels.get() + static_cast<size_t>(temp_image->scanline) * y;
+		kernels::active().repack_row_rgba_to_rgb(src, dst, image->width);
+	}
+	return temp_image;
+}
 
-	auto temp_image = std::make_shared<basic_image>(image->height, image->width, image->width * 3, basic_image::image_format::rgb24);
+static uint8_t get_bit_depth_for_palette_size(uint32_t palette_size)
+{
+	if(palette_size <= 2)
+		return 1;
+	if(palette_size <= 4)
+		return 2;
+	if(palette_size <= 16)
+		return 4;
+	return 8;
+}
+
+// Reduces palette of p8 image to the highest used index, without any reordering, since indices of H3 images carry meaning on their own
+static basic_image_ptr optimize_reduce_palette(const basic_image_ptr & image)
+{
+	uint8_t max_index = 0;
 
 	for(uint32_t y = 0; y < image->height; y++)
 	{
+		const uint8_t * row = image->pixels.get() + static_cast<size_t>(image->scanline) * y;
+		max_index = std::max(max_index, *std::max_element(row, row + image->width));
+	}
+
+	if(max_index + 1 >= image->palette_size)
+		return image;
+
+	auto temp_image = std::make_shared<basic_image>(image->height, image->width, image->scanline, basic_image::image_format::p8);
+
+	std::copy_n(image->pixels.get(), static_cast<size_t>(image->scanline) * image->height, temp_image->pixels.get());
+	std::copy_n(image->palette.get(), 256 * 3, temp_image->palette.get());
+	if(image->palette_alpha)
+	{
+		temp_image->palette_alpha.reset(new uint8_t[256]);
+		std::copy_n(image->palette_alpha.get(), 256, temp_image->palette_alpha.get());
+	}
+
+	temp_image->palette_size = max_index + 1;
+	temp_image->bit_depth = get_bit_depth_for_palette_size(temp_image->palette_size);
+	return temp_image;
+}
+
+namespace
+{
+	// Collects set of unique colors of an image, up to the size of 256-entry palette
+	class color_histogram
+	{
+		static constexpr uint32_t max_colors = 256;
+		static constexpr uint32_t table_size = 1024;
+		static constexpr uint16_t empty_slot = 0xffff;
+
+		std::array<uint32_t, table_size> slot_color;
+		std::array<uint16_t, table_size> slot_index;
+		std::vector<uint32_t> unique_colors;
+
+		static uint32_t pack(uint8_t b, uint8_t g, uint8_t r, uint8_t a)
+		{
+			return b | g << 8 | r << 16 | uint32_t(a) << 24;
+		}
+
+		static uint32_t hash(uint32_t color)
+		{
+			return (color * 0x9E3779B1u) >> 22;
+		}
+
+		uint32_t find_slot(uint32_t color) const
+		{
+			uint32_t slot = hash(color);
+			while(slot_index[slot] != empty_slot && slot_color[slot] != color)
+				slot = (slot + 1) % table_size;
+			return slot;
+		}
+
+	public:
+		bool opaque = true;
+		bool gray = true;
+		bool overflow = false;
+
+		color_histogram()
+		{
+			slot_index.fill(empty_slot);
+			unique_colors.reserve(max_colors);
+		}
+
+		void add(uint8_t b, uint8_t g, uint8_t r, uint8_t a)
+		{
+			opaque &= a == 0xff;
+			gray &= b == g && g == r;
+
+			if(overflow)
+				return;
+
+			uint32_t color = pack(b, g, r, a);
+			uint32_t slot = find_slot(color);
+			if(slot_index[slot] != empty_slot)
+				return;
+
+			if(unique_colors.size() == max_colors)
+			{
+				overflow = true;
+				return;
+			}
+
+			slot_color[slot] = color;
+			slot_index[slot] = static_cast<uint16_t>(unique_colors.size());
+			unique_colors.push_back(color);
+		}
+
+		// Assigns palette indices, with translucent colors first, to keep tRNS chunk as short as possible
+		const std::vector<uint32_t> & build_palette()
+		{
+			std::stable_sort(unique_colors.begin(), unique_colors.end(), [](uint32_t left, uint32_t right){
+				return (left >> 24) != 0xff && (right >> 24) == 0xff;
+			});
+
+			for(size_t i = 0; i < unique_colors.size(); ++i)
+				slot_index[find_slot(unique_colors[i])] = static_cast<uint16_t>(i);
+
+			return unique_colors;
+		}
+
+		uint8_t get_index(uint8_t b, uint8_t g, uint8_t r, uint8_t a) const
+		{
+			return static_cast<uint8_t>(slot_index[find_slot(pack(b, g, r, a))]);
+		}
+	};
+}
+
+basic_image_ptr file_format_png::optimize_reduce_format(const basic_image_ptr & image)
+{
+	if(image->format == basic_image::image_format::p8)
+		return optimize_reduce_palette(image);
+
+	if(image->format != basic_image::image_format::rgb24 && image->format != basic_image::image_format::rgba32)
+		return image;
+
+	bool has_alpha = image->format == basic_image::image_format::rgba32;
+	uint32_t bpp = image->bytes_per_pixel;
+
+	color_histogram histogram;
+
+	for(uint32_t y = 0; y < image->height; y++)
+	{
+		const uint8_t * row = image->pixels.get() + static_cast<size_t>(image->scanline) * y;
 		for(uint32_t x = 0; x < image->width; x++)
 		{
-			auto dst = temp_image->rgb(x, y);
-			auto src = image->rgba(x, y);
+			const uint8_t * pixel = row + x * bpp;
+			histogram.add(pixel[0], pixel[1], pixel[2], has_alpha ? pixel[3] : 0xff);
+		}
+
+		if(histogram.overflow && !histogram.gray && !histogram.opaque)
+			return image;
+	}
+
+	auto for_each_pixel = [&](const basic_image_ptr & target, auto && callback)
+	{
+		for(uint32_t y = 0; y < image->height; y++)
+		{
+			const uint8_t * src = image->pixels.get() + static_cast<size_t>(image->scanline) * y;
+			uint8_t * dst = target->pixels.get() + static_cast<size_t>(target->scanline) * y;
+			for(uint32_t x = 0; x < image->width; x++)
+				callback(src + x * bpp, dst + x * target->bytes_per_pixel);
+		}
+	};
+
+	// palette with 8-bit indices is never smaller than opaque grayscale, but sub-byte indices are
+	bool prefer_gray = histogram.gray && histogram.opaque && (histogram.overflow || histogram.build_palette().size() > 16);
+
+	if(!histogram.overflow && !prefer_gray)
+	{
+		const auto & colors = histogram.build_palette();
+		auto temp_image = std::make_shared<basic_image>(image->height, image->width, image->width, basic_image::image_format::p8);
+
+		temp_image->palette_size = static_cast<uint16_t>(colors.size());
+		temp_image->bit_depth = get_bit_depth_for_palette_size(temp_image->palette_size);
+
+		if(!histogram.opaque)
+		{
+			temp_image->palette_alpha.reset(new uint8_t[256]);
+			std::fill_n(temp_image->palette_alpha.get(), 256, uint8_t(0xff));
+		}
 
-			dst.set_red(src.red());
-			dst.set_green(src.green());
-			dst.set_blue(src.blue());
+		for(size_t i = 0; i < colors.size(); ++i)
+		{
+			auto color = temp_image->color(static_cast<uint32_t>(i));
+			color.set_red((colors[i] >> 16) & 0xff);
+			color.set_green((colors[i] >> 8) & 0xff);
+			color.set_blue(colors[i] & 0xff);
+			if(temp_image->palette_alpha)
+				temp_image->palette_alpha[i] = colors[i] >> 24;
 		}
+
+		for_each_pixel(temp_image, [&](const uint8_t * src, uint8_t * dst){
+			dst[0] = histogram.get_index(src[0], src[1], src[2], has_alpha ? src[3] : 0xff);
+		});
+		return temp_image;
 	}
-	return temp_image;
+
+	if(histogram.gray && histogram.opaque)
+	{
+		auto temp_image = std::make_shared<basic_image>(image->height, image->width, image->width, basic_image::image_format::g8);
+		for_each_pixel(temp_image, [&](const uint8_t * src, uint8_t * dst){
+			dst[0] = src[0];
+		});
+		return temp_image;
+	}
+
+	if(histogram.gray)
+	{
+		auto temp_image = std::make_shared<basic_image>(image->height, image->width, image->width * 2, basic_image::image_format::ga16);
+		for_each_pixel(temp_image, [&](const uint8_t * src, uint8_t * dst){
+			dst[0] = src[0];
+			dst[1] = src[3];
+		});
+		return temp_image;
+	}
+
+	return optimize_try_drop_alpha(image);
+}
+
+// Number of entries that have to be written into tRNS chunk - all entries after last translucent one are opaque
+static int get_transparent_palette_size(const basic_image & image)
+{
+	int result = 0;
+	for(int i = 0; i < image.palette_size; ++i)
+		if(image.palette_alpha[i] != 0xff)
+			result = i + 1;
+	return result;
 }
 
-void file_format_png::optimize_and_save(const basic_image_ptr & image, const std::filesystem::path & filename)
+struct png_encode_settings
 {
-	save_image(optimize_try_drop_alpha(image), filename);
+	int compression_level;
+	int compression_strategy;
+	int filters;
+};
+
+// Paletted images (mostly DEF frames) consist of long runs of same index and don't benefit from filtering,
+// while truecolor images (P32, D32, HD sprites) are smooth enough for prediction filters to pay off
+static png_encode_settings get_encode_settings(file_format_png::encode_profile profile, basic_image::image_format format)
+{
+	bool indexed = format == basic_image::image_format::p8;
+
+	switch(profile)
+	{
+		case file_format_png::encode_profile::fast:
+			if(indexed)
+				return { 1, Z_RLE, PNG_FILTER_NONE };
+			return { 1, Z_DEFAULT_STRATEGY, PNG_FILTER_SUB };
+
+		case file_format_png::encode_profile::balanced:
+			if(indexed)
+				return { 6, Z_DEFAULT_STRATEGY, PNG_FILTER_NONE };
+			return { 6, Z_FILTERED, PNG_FILTER_SUB | PNG_FILTER_UP | PNG_FILTER_PAETH };
+
+		case file_format_png::encode_profile::max:
+		default:
+			if(indexed)
+				return { 9, Z_DEFAULT_STRATEGY, PNG_FILTER_NONE };
+			return { 9, Z_FILTERED, PNG_ALL_FILTERS };
+	}
 }
 
-void file_format_png::save_image(const basic_image_ptr & image, const std::filesystem::path & filename)
+static void encode_image_builtin(const basic_image_ptr & image, std::vector<uint8_t> & output, const png_encode_settings & settings);
+
+static void write_file(const std::filesystem::path & filename, const std::vector<uint8_t> & data)
 {
 	FILE * fp = fopen(filename.string().c_str(), "wb");
 	assert(fp);
 
+	fwrite(data.data(), 1, data.size(), fp);
+	fclose(fp);
+}
+
+// Encoding buffers are kept per thread and reused between images, so after first few images encoding does not allocates
+static std::vector<uint8_t> & get_thread_encode_buffer()
+{
+	thread_local std::vector<uint8_t> buffer;
+	buffer.clear();
+	return buffer;
+}
+
+static void write_png_to_buffer(png_structp png, png_bytep data, png_size_t length)
+{
+	auto * output = static_cast<std::vector<uint8_t> *>(png_get_io_ptr(png));
+	output->insert(output->end(), data, data + length);
+}
+
+static void flush_png_buffer(png_structp)
+{
+}
+
+void file_format_png::optimize_and_encode(const basic_image_ptr & image, std::vector<uint8_t> & output, encode_profile profile)
+{
+	// full analysis is not worth it when speed is preferred over size
+	if(profile == encode_profile::fast)
+		encode_image(optimize_try_drop_alpha(image), output, profile);
+	else
+		encode_image(optimize_reduce_format(image), output, profile);
+}
+
+void file_format_png::optimize_and_save(const basic_image_ptr & image, const std::filesystem::path & filename, encode_profile profile)
+{
+	auto & buffer = get_thread_encode_buffer();
+	optimize_and_encode(image, buffer, profile);
+	write_file(filename, buffer);
+}
+
+void file_format_png::save_image(const basic_image_ptr & image, const std::filesystem::path & filename, encode_profile profile)
+{
+	auto & buffer = get_thread_encode_buffer();
+	encode_image(image, buffer, profile);
+	write_file(filename, buffer);
+}
+
+void file_format_png::encode_image(const basic_image_ptr & image, std::vector<uint8_t> & output, encode_profile profile)
+{
+	png_encode_settings settings = get_encode_settings(profile, image->format);
+
+	// libpng compresses on a single thread, which leaves large images as the slowest part of a batch
+	bool large_image = static_cast<size_t>(image->width) * image->height >= parallel_encode_threshold && parallel::max_threads() > 1;
+
+	if(profile == encode_profile::fast || large_image)
+	{
+		encode_image_builtin(image, output, settings);
+		return;
+	}
+
+	// libpng does not supports reuse of png_struct for multiple images, so only output buffer and row pointers are kept between calls
+	thread_local std::vector<uint8_t *> row_pointers;
+
 	png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
 	assert(png);
 
 	png_infop info = png_create_info_struct(png);
 	assert(info);
 
-	png_init_io(png, fp);
+	png_set_write_fn(png, &output, write_png_to_buffer, flush_png_buffer);
 
 	png_set_IHDR(
 		png,
 		info,
 		image->width,
 		image->height,
-		8,
+		image->bit_depth,
 		get_png_color_type_from_format(image->format),
 		PNG_INTERLACE_NONE,
 		PNG_COMPRESSION_TYPE_DEFAULT,
 		PNG_FILTER_TYPE_DEFAULT
 	);
 
-	png_set_compression_level(png, 9);
+	png_set_compression_level(png, settings.compression_level);
+	png_set_compression_strategy(png, settings.compression_strategy);
+	png_set_filter(png, PNG_FILTER_TYPE_BASE, settings.filters);
 
 	if(image->palette)
 	{
 		std::array<png_color, 256> palette;
 
-		for(int i = 0; i < 256; i++)
+		for(int i = 0; i < image->palette_size; i++)
 		{
 			palette[i].red = image->color(i).red();
 			palette[i].green = image->color(i).green();
 			palette[i].blue = image->color(i).blue();
 		}
 
-		png_set_PLTE(png, info, palette.data(), 256);
+		png_set_PLTE(png, info, palette.data(), image->palette_size);
+	}
+
+	if(image->palette_alpha)
+	{
+		int transparent_entries = get_transparent_palette_size(*image);
+		if(transparent_entries != 0)
+			png_set_tRNS(png, info, image->palette_alpha.get(), transparent_entries, nullptr);
 	}
 
-	std::vector<uint8_t *> row_pointers(image->height);
+	row_pointers.resize(image->height);
 	for(uint32_t y = 0; y < image->height; y++)
 		row_pointers[y] = image->pixels.get() + static_cast<size_t>(image->scanline) * y;
 
 	png_set_rows(png, info, row_pointers.data());
-	png_write_png(png, info, PNG_TRANSFORM_BGR, nullptr);
+	png_write_png(png, info, PNG_TRANSFORM_BGR | (image->bit_depth < 8 ? PNG_TRANSFORM_PACKING : 0), nullptr);
 
 	png_destroy_write_struct(&png, &info);
+}
+
+static void write_u32_be(std::vector<uint8_t> & output, uint32_t value)
+{
+	output.push_back(value >> 24);
+	output.push_back(value >> 16);
+	output.push_back(value >> 8);
+	output.push_back(value >> 0);
+}
+
+static void write_png_chunk(std::vector<uint8_t> & output, const char * type, const uint8_t * data, size_t size)
+{
+	write_u32_be(output, static_cast<uint32_t>(size));
+
+	size_t chunk_start = output.size();
+	output.insert(output.end(), type, type + 4);
+	output.insert(output.end(), data, data + size);
+
+	uLong crc = crc32(0, output.data() + chunk_start, static_cast<uInt>(size + 4));
+	write_u32_be(output, static_cast<uint32_t>(crc));
+}
+
+// Converts row from internal BGR(A) layout into PNG RGB(A) layout
+static void load_png_row(const basic_image & image, uint32_t y, uint8_t * output)
+{
+	const uint8_t * input = image.pixels.get() + static_cast<size_t>(image.scanline) * y;
+
+	switch(image.format)
+	{
+		case basic_image::image_format::rgb24:
+			for(uint32_t x = 0; x < image.width; ++x)
+			{
+				output[x * 3 + 0] = input[x * 3 + 2];
+				output[x * 3 + 1] = input[x * 3 + 1];
+				output[x * 3 + 2] = input[x * 3 + 0];
+			}
+			break;
+		case basic_image::image_format::rgba32:
+			for(uint32_t x = 0; x < image.width; ++x)
+			{
+				output[x * 4 + 0] = input[x * 4 + 2];
+				output[x * 4 + 1] = input[x * 4 + 1];
+				output[x * 4 + 2] = input[x * 4 + 0];
+				output[x * 4 + 3] = input[x * 4 + 3];
+			}
+			break;
+		case basic_image::image_format::ga16:
+			std::copy_n(input, image.width * 2, output);
+			break;
+		case basic_image::image_format::p8:
+			if(image.bit_depth < 8)
+			{
+				uint32_t pixels_per_byte = 8 / image.bit_depth;
+				std::fill_n(output, (image.width + pixels_per_byte - 1) / pixels_per_byte, uint8_t(0));
+				for(uint32_t x = 0; x < image.width; ++x)
+				{
+					uint32_t shift = 8 - image.bit_depth * (x % pixels_per_byte + 1);
+					output[x / pixels_per_byte] |= input[x] << shift;
+				}
+				break;
+			}
+			std::copy_n(input, image.width, output);
+			break;
+		default:
+			std::copy_n(input, image.width, output);
+			break;
+	}
+}
+
+static uint8_t paeth_predictor(uint8_t a, uint8_t b, uint8_t c)
+{
+	int p = a + b - c;
+	int pa = std::abs(p - a);
+	int pb = std::abs(p - b);
+	int pc = std::abs(p - c);
+
+	if(pa <= pb && pa <= pc)
+		return a;
+	if(pb <= pc)
+		return b;
+	return c;
+}
+
+static void apply_png_filter(uint8_t filter, const uint8_t * current, const uint8_t * previous, size_t row_size, size_t bpp, uint8_t * output)
+{
+	output[0] = filter;
+	output += 1;
+
+	for(size_t i = 0; i < row_size; ++i)
+	{
+		uint8_t a = i >= bpp ? current[i - bpp] : 0;
+		uint8_t b = previous[i];
+		uint8_t c = i >= bpp ? previous[i - bpp] : 0;
+
+		switch(filter)
+		{
+			case PNG_FILTER_VALUE_NONE:
+				output[i] = current[i];
+				break;
+			case PNG_FILTER_VALUE_SUB:
+				output[i] = current[i] - a;
+				break;
+			case PNG_FILTER_VALUE_UP:
+				output[i] = current[i] - b;
+				break;
+			case PNG_FILTER_VALUE_AVG:
+				output[i] = current[i] - (a + b) / 2;
+				break;
+			case PNG_FILTER_VALUE_PAETH:
+				output[i] = current[i] - paeth_predictor(a, b, c);
+				break;
+		}
+	}
+}
+
+// Filters rows [first_row, last_row) into output. If more than one filter is allowed, picks filter with
+// minimal sum of absolute differences for each row, same heuristic as used by libpng
+static void filter_png_rows(const basic_image & image, int filters, uint32_t first_row, uint32_t last_row, uint8_t * output)
+{
+	static const std::array<std::pair<int, uint8_t>, 5> all_filters = {{
+		{ PNG_FILTER_NONE, PNG_FILTER_VALUE_NONE },
+		{ PNG_FILTER_SUB, PNG_FILTER_VALUE_SUB },
+		{ PNG_FILTER_UP, PNG_FILTER_VALUE_UP },
+		{ PNG_FILTER_AVG, PNG_FILTER_VALUE_AVG },
+		{ PNG_FILTER_PAETH, PNG_FILTER_VALUE_PAETH },
+	}};
+
+	size_t row_size = (static_cast<size_t>(image.width) * image.bytes_per_pixel * image.bit_depth + 7) / 8;
+	size_t bpp = std::max<size_t>(1, image.bytes_per_pixel * image.bit_depth / 8);
+
+	std::vector<uint8_t> current_row(row_size);
+	std::vector<uint8_t> previous_row(row_size, 0);
+	std::vector<uint8_t> candidate(row_size + 1);
+
+	if(first_row != 0)
+		load_png_row(image, first_row - 1, previous_row.data());
+
+	for(uint32_t y = first_row; y < last_row; ++y)
+	{
+		uint8_t * row_output = output + (row_size + 1) * (y - first_row);
+		uint64_t best_cost = UINT64_MAX;
+
+		load_png_row(image, y, current_row.data());
+
+		for(const auto & filter : all_filters)
+		{
+			if((filters & filter.first) == 0)
+				continue;
+
+			if(filters == filter.first)
+			{
+				apply_png_filter(filter.second, current_row.data(), previous_row.data(), row_size, bpp, row_output);
+				break;
+			}
+
+			apply_png_filter(filter.second, current_row.data(), previous_row.data(), row_size, bpp, candidate.data());
+
+			uint64_t cost = 0;
+			for(size_t i = 1; i <= row_size; ++i)
+				cost += std::abs(static_cast<int8_t>(candidate[i]));
+
+			if(cost < best_cost)
+			{
+				best_cost = cost;
+				std::copy(candidate.begin(), candidate.end(), row_output);
+			}
+		}
+
+		std::swap(current_row, previous_row);
+	}
+}
+
+// zlib header for 32K window, with compression level hint matching to one written by zlib itself
+static std::array<uint8_t, 2> get_zlib_header(int compression_level)
+{
+	if(compression_level == 1)
+		return { 0x78, 0x01 };
+	if(compression_level < 6)
+		return { 0x78, 0x5e };
+	if(compression_level == 6)
+		return { 0x78, 0x9c };
+	return { 0x78, 0xda };
+}
+
+// Compresses image data as a set of independent raw deflate blocks, in the style of pigz.
+// Every block is primed with last 32K of preceding data as dictionary and ends with sync flush,
+// so concatenation of all blocks forms a single valid zlib stream
+static std::vector<uint8_t> compress_parallel(const std::vector<uint8_t> & input, const png_encode_settings & settings)
+{
+	constexpr size_t block_size = 128 * 1024;
+	constexpr size_t dictionary_size = 32 * 1024;
+
+	size_t blocks_count = (input.size() + block_size - 1) / block_size;
+
+	std::vector<std::vector<uint8_t>> blocks(blocks_count);
+	std::vector<uLong> checksums(blocks_count);
+
+	parallel::for_each_index(blocks_count, [&](size_t index)
+	{
+		size_t block_begin = index * block_size;
+		size_t block_end = std::min(input.size(), block_begin + block_size);
+		bool last_block = index + 1 == blocks_count;
+
+		z_stream deflate_state{};
+
+		{
+			[[maybe_unused]] int ret = deflateInit2(&deflate_state, settings.compression_level, Z_DEFLATED, -15, 8, settings.compression_strategy);
+			assert(ret == Z_OK);
+		}
+
+		if(block_begin != 0)
+		{
+			size_t dictionary_begin = block_begin - std::min(block_begin, dictionary_size);
+			deflateSetDictionary(&deflate_state, input.data() + dictionary_begin, static_cast<uInt>(block_begin - dictionary_begin));
+		}
+
+		auto & output = blocks[index];
+		output.resize(deflateBound(&deflate_state, static_cast<uLong>(block_end - block_begin)) + 16);
+
+		deflate_state.next_in = const_cast<uint8_t *>(input.data() + block_begin);
+		deflate_state.avail_in = static_cast<uInt>(block_end - block_begin);
+		deflate_state.next_out = output.data();
+		deflate_state.avail_out = static_cast<uInt>(output.size());
+
+		{
+			[[maybe_unused]] int ret = deflate(&deflate_state, last_block ? Z_FINISH : Z_SYNC_FLUSH);
+			assert(ret == (last_block ? Z_STREAM_END : Z_OK));
+			assert(deflate_state.avail_in == 0);
+		}
+
+		output.resize(deflate_state.total_out);
+		deflateEnd(&deflate_state);
+
+		checksums[index] = adler32(adler32(0, nullptr, 0), input.data() + block_begin, static_cast<uInt>(block_end - block_begin));
+	});
+
+	auto header = get_zlib_header(settings.compression_level);
+	std::vector<uint8_t> result(header.begin(), header.end());
+
+	uLong checksum = adler32(0, nullptr, 0);
+	for(size_t i = 0; i < blocks_count; ++i)
+	{
+		size_t block_length = std::min(block_size, input.size() - i * block_size);
+		checksum = adler32_combine(checksum, checksums[i], static_cast<z_off_t>(block_length));
+		result.insert(result.end(), blocks[i].begin(), blocks[i].end());
+	}
+
+	write_u32_be(result, static_cast<uint32_t>(checksum));
+	return result;
+}
+
+static std::vector<uint8_t> compress_serial(const std::vector<uint8_t> & input, const png_encode_settings & settings)
+{
+	z_stream deflate_state{};
+
+	{
+		[[maybe_unused]] int ret = deflateInit2(&deflate_state, settings.compression_level, Z_DEFLATED, 15, 8, settings.compression_strategy);
+		assert(ret == Z_OK);
+	}
+
+	std::vector<uint8_t> compressed(deflateBound(&deflate_state, static_cast<uLong>(input.size())));
+
+	deflate_state.next_in = const_cast<uint8_t *>(input.data());
+	deflate_state.avail_in = static_cast<uInt>(input.size());
+	deflate_state.next_out = compressed.data();
+	deflate_state.avail_out = static_cast<uInt>(compressed.size());
+
+	{
+		[[maybe_unused]] int ret = deflate(&deflate_state, Z_FINISH);
+		assert(ret == Z_STREAM_END);
+	}
+
+	compressed.resize(deflate_state.total_out);
+	deflateEnd(&deflate_state);
+	return compressed;
+}
+
+// Built-in encoder that does not uses libpng. Large images are filtered and compressed on multiple threads
+static void encode_image_builtin(const basic_image_ptr & image, std::vector<uint8_t> & output, const png_encode_settings & settings)
+{
+	constexpr uint32_t rows_per_task = 64;
+
+	size_t row_size = (static_cast<size_t>(image->width) * image->bytes_per_pixel * image->bit_depth + 7) / 8;
+	size_t filtered_size = (row_size + 1) * image->height;
+	bool use_threads = static_cast<size_t>(image->width) * image->height >= file_format_png::parallel_encode_threshold;
+
+	thread_local std::vector<uint8_t> filtered;
+	filtered.resize(filtered_size);
+
+	if(use_threads)
+	{
+		// workers have their own instances of thread_local buffer, so they must write through pointer to buffer of this thread
+		uint8_t * filtered_data = filtered.data();
+		size_t tasks_count = (image->height + rows_per_task - 1) / rows_per_task;
+		parallel::for_each_index(tasks_count, [&](size_t index)
+		{
+			uint32_t first_row = static_cast<uint32_t>(index * rows_per_task);
+			uint32_t last_row = std::min(image->height, first_row + rows_per_task);
+			filter_png_rows(*image, settings.filters, first_row, last_row, filtered_data + (row_size + 1) * first_row);
+		});
+	}
+	else
+		filter_png_rows(*image, settings.filters, 0, image->height, filtered.data());
+
+	std::vector<uint8_t> compressed = use_threads ? compress_parallel(filtered, settings) : compress_serial(filtered, settings);
+
+	output.reserve(output.size() + compressed.size() + 1024);
+
+	static const uint8_t png_signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	output.insert(output.end(), png_signature, png_signature + 8);
+
+	std::vector<uint8_t> header;
+	write_u32_be(header, image->width);
+	write_u32_be(header, image->height);
+	header.push_back(image->bit_depth);
+	header.push_back(get_png_color_type_from_format(image->format));
+	header.push_back(PNG_COMPRESSION_TYPE_BASE);
+	header.push_back(PNG_FILTER_TYPE_BASE);
+	header.push_back(PNG_INTERLACE_NONE);
+	write_png_chunk(output, "IHDR", header.data(), header.size());
+
+	if(image->palette)
+		write_png_chunk(output, "PLTE", image->palette.get(), image->palette_size * 3);
+
+	if(image->palette_alpha && get_transparent_palette_size(*image) != 0)
+		write_png_chunk(output, "tRNS", image->palette_alpha.get(), get_transparent_palette_size(*image));
+
+	write_png_chunk(output, "IDAT", compressed.data(), compressed.size());
+	write_png_chunk(output, "IEND", nullptr, 0);
+}
+
+// libpng reports errors through longjmp, so calls that may fail are made from functions without objects that have destructors
+static bool read_png_header(png_structp png, png_infop info)
+{
+	if(setjmp(png_jmpbuf(png)))
+		return false;
+
+	png_read_info(png, info);
+
+	int bit_depth = png_get_bit_depth(png, info);
+	int color_type = png_get_color_type(png, info);
+
+	// convert everything into one byte per channel, with BGR(A) order for color images
+	if(bit_depth == 16)
+		png_set_strip_16(png);
+	if(bit_depth < 8)
+		png_set_packing(png);
+	if(color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
+		png_set_expand_gray_1_2_4_to_8(png);
+	if(color_type == PNG_COLOR_TYPE_RGB || color_type == PNG_COLOR_TYPE_RGB_ALPHA)
+		png_set_bgr(png);
+
+	png_read_update_info(png, info);
+	return true;
+}
+
+static bool read_png_rows(png_structp png, png_bytepp rows)
+{
+	if(setjmp(png_jmpbuf(png)))
+		return false;
+
+	png_read_image(png, rows);
+	png_read_end(png, nullptr);
+	return true;
+}
+
+basic_image_ptr file_format_png::load_image(const std::filesystem::path & filename)
+{
+	FILE * fp = fopen(filename.string().c_str(), "rb");
+	if(!fp)
+		throw format_error("failed to open '" + filename.string() + "'");
+
+	png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+	assert(png);
+
+	png_infop info = png_create_info_struct(png);
+	assert(info);
+
+	png_init_io(png, fp);
+
+	auto fail = [&]()
+	{
+		png_destroy_read_struct(&png, &info, nullptr);
+		fclose(fp);
+		throw format_error("damaged png file '" + filename.string() + "'");
+	};
+
+	if(!read_png_header(png, info))
+		fail();
+
+	uint32_t width = png_get_image_width(png, info);
+	uint32_t height = png_get_image_height(png, info);
+	int color_type = png_get_color_type(png, info);
+
+	basic_image::image_format format = basic_image::image_format::invalid;
+	switch(color_type)
+	{
+		case PNG_COLOR_TYPE_PALETTE:
+			format = basic_image::image_format::p8;
+			break;
+		case PNG_COLOR_TYPE_GRAY:
+			format = basic_image::image_format::g8;
+			break;
+		case PNG_COLOR_TYPE_GRAY_ALPHA:
+			format = basic_image::image_format::ga16;
+			break;
+		case PNG_COLOR_TYPE_RGB:
+			format = basic_image::image_format::rgb24;
+			break;
+		case PNG_COLOR_TYPE_RGB_ALPHA:
+			format = basic_image::image_format::rgba32;
+			break;
+		default:
+			fail();
+	}
+
+	auto image = std::make_shared<basic_image>(height, width, static_cast<uint32_t>(png_get_rowbytes(png, info)), format, false);
+
+	if(format == basic_image::image_format::p8)
+	{
+		png_colorp palette = nullptr;
+		int palette_size = 0;
+		png_get_PLTE(png, info, &palette, &palette_size);
+
+		std::fill_n(image->palette.get(), 256 * 3, uint8_t(0));
+		for(int i = 0; i < palette_size; i++)
+		{
+			image->color(i).set_red(palette[i].red);
+			image->color(i).set_green(palette[i].green);
+			image->color(i).set_blue(palette[i].blue);
+		}
+		image->palette_size = static_cast<uint16_t>(palette_size);
+
+		png_bytep transparency = nullptr;
+		int transparency_size = 0;
+		if(png_get_tRNS(png, info, &transparency, &transparency_size, nullptr) && transparency_size > 0)
+		{
+			image->palette_alpha.reset(new uint8_t[256]);
+			std::fill_n(image->palette_alpha.get(), 256, uint8_t(0xff));
+			std::copy_n(transparency, transparency_size, image->palette_alpha.get());
+		}
+	}
+
+	std::vector<uint8_t *> row_pointers(height);
+	for(uint32_t y = 0; y < height; y++)
+		row_pointers[y] = image->pixels.get() + static_cast<size_t>(image->scanline) * y;
+
+	if(!read_png_rows(png, row_pointers.data()))
+		fail();
+
+	png_destroy_read_struct(&png, &info, nullptr);
 	fclose(fp);
+
+	return image;
 }
@@ -4,6 +4,7 @@
 #include <cstdint>
 #include <memory>
 #include <filesystem>
+#include <vector>
 
 struct image_pixel_indexed
 {
@@ -21,6 +22,17 @@ struct image_pixel_gray
 	uint8_t const & gray() const { return ptr[0]; }
 };
 
+struct image_pixel_gray_alpha
+{
+	uint8_t * ptr;
+
+	void set_gray (uint8_t value) { ptr[0] = value; }
+	void set_alpha(uint8_t value) { ptr[1] = value; }
+
+	uint8_t const & gray () const { return ptr[0]; }
+	uint8_t const & alpha() const { return ptr[1]; }
+};
+
 struct image_pixel_rgb
 {
 	uint8_t * ptr;
@@ -57,18 +69,22 @@ struct basic_image
 	{
 		p8,
 		g8,
+		ga16,
 		rgb24,
 		rgba32,
 		invalid,
 	};
 
 	std::unique_ptr<uint8_t[]> palette;
+	std::unique_ptr<uint8_t[]> palette_alpha; // optional, per-entry alpha of palette
 	std::unique_ptr<uint8_t[]> pixels;
 	uint32_t scanline;
 	uint32_t height;
 	uint32_t width;
 	image_format format;
 	uint8_t bytes_per_pixel;
+	uint8_t bit_depth = 8; // less than 8 only for p8 images that use no more than 16 palette entries
+	uint16_t palette_size = 256;
 
 	image_pixel_rgb color(uint32_t index)
 	{
@@ -89,6 +105,12 @@ struct basic_image
 		return {get_pixel_ptr(col, row)};
 	}
 
+	image_pixel_gray_alpha gray_alpha(uint32_t col, uint32_t row)
+	{
+		assert(format == image_format::ga16);
+		return {get_pixel_ptr(col, row)};
+	}
+
 	image_pixel_rgb rgb(uint32_t col, uint32_t row)
 	{
 		assert(format == image_format::rgb24);
@@ -108,7 +130,7 @@ struct basic_image
 		return pixels.get() + scanline * size_t(row) + bytes_per_pixel * size_t(col);
 	}
 
-	basic_image(uint32_t height, uint32_t width, uint32_t scanline, image_format format);
+	basic_image(uint32_t height, uint32_t width, uint32_t scanline, image_format format, bool clear = true);
 
 	basic_image section(uint32_t left, uint32_t top, uint32_t width, uint32_t height);
 	basic_image rotateCounterclockwise();
@@ -118,7 +140,25 @@ using basic_image_ptr = std::shared_ptr<basic_image>;
 
 namespace file_format_png
 {
+	enum class encode_profile : uint8_t
+	{
+		fast,     // built-in encoder with fixed filter and fastest deflate settings
+		balanced, // libpng with moderate compression level
+		max,      // libpng with maximal compression level
+	};
+
+	// images with this many pixels or more are filtered and compressed on multiple threads
+	constexpr size_t parallel_encode_threshold = 1024 * 1024;
+
+	// converts paletted image to rgba32. If palette_alpha is set, it must contain alpha for all 256 palette entries
+	basic_image_ptr expand_palette(basic_image_ptr const& image, const uint8_t * palette_alpha = nullptr);
+
 	basic_image_ptr optimize_try_drop_alpha(basic_image_ptr const& image);
-	void optimize_and_save(basic_image_ptr const& image, std::filesystem::path const& filename);
-	void save_image( basic_image_ptr const& image, std::filesystem::path const & filename );
+	basic_image_ptr optimize_reduce_format(basic_image_ptr const& image);
+	void optimize_and_save(basic_image_ptr const& image, std::filesystem::path const& filename, encode_profile profile = encode_profile::max);
+	void optimize_and_encode(basic_image_ptr const& image, std::vector<uint8_t> & output, encode_profile profile = encode_profile::max);
+	void save_image( basic_image_ptr const& image, std::filesystem::path const & filename, encode_profile profile = encode_profile::max );
+	void encode_image( basic_image_ptr const& image, std::vector<uint8_t> & output, encode_profile profile = encode_profile::max );
+
+	basic_image_ptr load_image( std::filesystem::path const & filename );
 }
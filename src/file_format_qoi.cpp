@@ -0,0 +1,168 @@
+#include "file_format_qoi.h"
+
+#include <array>
+#include <vector>
+
+// Encoder for "Quite OK Image" format, see https://qoiformat.org/qoi-specification.pdf
+
+namespace
+{
+	enum qoi_op : uint8_t
+	{
+		QOI_OP_INDEX = 0x00,
+		QOI_OP_DIFF  = 0x40,
+		QOI_OP_LUMA  = 0x80,
+		QOI_OP_RUN   = 0xc0,
+		QOI_OP_RGB   = 0xfe,
+		QOI_OP_RGBA  = 0xff,
+	};
+
+	struct qoi_pixel
+	{
+		uint8_t r = 0;
+		uint8_t g = 0;
+		uint8_t b = 0;
+		uint8_t a = 0;
+
+		bool operator==(const qoi_pixel & other) const
+		{
+			return r == other.r && g == other.g && b == other.b && a == other.a;
+		}
+
+		uint32_t hash() const
+		{
+			return (r * 3 + g * 5 + b * 7 + a * 11) % 64;
+		}
+	};
+}
+
+static void write_u32_be(std::vector<uint8_t> & output, uint32_t value)
+{
+	output.push_back(value >> 24);
+	output.push_back(value >> 16);
+	output.push_back(value >> 8);
+	output.push_back(value >> 0);
+}
+
+// pixels in basic_image are stored in BGR(A) order, palette is stored in RGB order
+static qoi_pixel load_pixel(const basic_image & image, const uint8_t * pixel)
+{
+	switch(image.format)
+	{
+		case basic_image::image_format::p8:
+		{
+			const uint8_t * color = image.palette.get() + 3 * pixel[0];
+			return { color[0], color[1], color[2], 0xff };
+		}
+		case basic_image::image_format::g8:
+			return { pixel[0], pixel[0], pixel[0], 0xff };
+		case basic_image::image_format::rgb24:
+			return { pixel[2], pixel[1], pixel[0], 0xff };
+		case basic_image::image_format::rgba32:
+			return { pixel[2], pixel[1], pixel[0], pixel[3] };
+		default:
+			assert(0);
+			return {};
+	}
+}
+
+void file_format_qoi::encode_image(const basic_image_ptr & image, std::vector<uint8_t> & output)
+{
+
+	// worst case is 5 bytes per pixel, but typical images are way smaller than that
+	output.reserve(output.size() + 14 + size_t(image->width) * image->height * 2 + 8);
+
+	output.push_back('q');
+	output.push_back('o');
+	output.push_back('i');
+	output.push_back('f');
+	write_u32_be(output, image->width);
+	write_u32_be(output, image->height);
+	output.push_back(image->format == basic_image::image_format::rgba32 ? 4 : 3);
+	output.push_back(0); // sRGB with linear alpha
+
+	std::array<qoi_pixel, 64> index{};
+	qoi_pixel previous = { 0, 0, 0, 0xff };
+	uint32_t run = 0;
+
+	for(uint32_t y = 0; y < image->height; ++y)
+	{
+		const uint8_t * row = image->pixels.get() + size_t(image->scanline) * y;
+
+		for(uint32_t x = 0; x < image->width; ++x)
+		{
+			qoi_pixel current = load_pixel(*image, row + x * image->bytes_per_pixel);
+
+			if(current == previous)
+			{
+				++run;
+				if(run == 62)
+				{
+					output.push_back(QOI_OP_RUN | (run - 1));
+					run = 0;
+				}
+				continue;
+			}
+
+			if(run > 0)
+			{
+				output.push_back(QOI_OP_RUN | (run - 1));
+				run = 0;
+			}
+
+			uint32_t index_pos = current.hash();
+
+			if(index[index_pos] == current)
+			{
+				output.push_back(QOI_OP_INDEX | index_pos);
+			}
+			else
+			{
+				index[index_pos] = current;
+
+				if(current.a == previous.a)
+				{
+					int8_t vr = int8_t(current.r - previous.r);
+					int8_t vg = int8_t(current.g - previous.g);
+					int8_t vb = int8_t(current.b - previous.b);
+
+					int8_t vg_r = int8_t(vr - vg);
+					int8_t vg_b = int8_t(vb - vg);
+
+					if(vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2)
+					{
+						output.push_back(QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2));
+					}
+					else if(vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8)
+					{
+						output.push_back(QOI_OP_LUMA | (vg + 32));
+						output.push_back((vg_r + 8) << 4 | (vg_b + 8));
+					}
+					else
+					{
+						output.push_back(QOI_OP_RGB);
+						output.push_back(current.r);
+						output.push_back(current.g);
+						output.push_back(current.b);
+					}
+				}
+				else
+				{
+					output.push_back(QOI_OP_RGBA);
+					output.push_back(current.r);
+					output.push_back(current.g);
+					output.push_back(current.b);
+					output.push_back(current.a);
+				}
+			}
+			previous = current;
+		}
+	}
+
+	if(run > 0)
+		output.push_back(QOI_OP_RUN | (run - 1));
+
+	for(int i = 0; i < 7; ++i)
+		output.push_back(0);
+	output.push_back(1);
+}
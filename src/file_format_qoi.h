@@ -0,0 +1,8 @@
+#pragma once
+
+#include "file_format_png.h"
+
+namespace file_format_qoi
+{
+	void encode_image(basic_image_ptr const& image, std::vector<uint8_t> & output);
+}
@@ -0,0 +1,82 @@
+#include "file_format_tga.h"
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Uncompressed Truevision TGA. Pixel data of basic_image is already in BGR(A) order used by TGA,
+// so all formats except palette can be written line by line without any conversion
+
+enum tga_image_type : uint8_t
+{
+	TGA_TYPE_COLOR_MAPPED = 1,
+	TGA_TYPE_TRUE_COLOR   = 2,
+	TGA_TYPE_GRAYSCALE    = 3,
+};
+
+enum tga_descriptor_flags : uint8_t
+{
+	TGA_ORIGIN_TOP = 0x20,
+};
+
+static void write_u16_le(std::vector<uint8_t> & output, uint16_t value)
+{
+	output.push_back(value & 0xff);
+	output.push_back(value >> 8);
+}
+
+void file_format_tga::encode_image(const basic_image_ptr & image, std::vector<uint8_t> & output)
+{
+	// dimensions are stored as 16-bit values
+	if(image->width > 0xffff || image->height > 0xffff)
+		throw std::runtime_error("image of size " + std::to_string(image->width) + "x" + std::to_string(image->height) + " is too large for tga");
+
+	bool has_palette = image->format == basic_image::image_format::p8;
+	bool has_alpha = image->format == basic_image::image_format::rgba32;
+	size_t row_size = size_t(image->width) * image->bytes_per_pixel;
+
+	output.reserve(output.size() + 18 + (has_palette ? 256 * 3 : 0) + row_size * image->height);
+
+	output.push_back(0); // id length
+	output.push_back(has_palette ? 1 : 0);
+
+	switch(image->format)
+	{
+		case basic_image::image_format::p8:
+			output.push_back(TGA_TYPE_COLOR_MAPPED);
+			break;
+		case basic_image::image_format::g8:
+			output.push_back(TGA_TYPE_GRAYSCALE);
+			break;
+		default:
+			output.push_back(TGA_TYPE_TRUE_COLOR);
+			break;
+	}
+
+	write_u16_le(output, 0); // first palette entry
+	write_u16_le(output, has_palette ? 256 : 0);
+	output.push_back(has_palette ? 24 : 0);
+
+	write_u16_le(output, 0); // x origin
+	write_u16_le(output, 0); // y origin
+	write_u16_le(output, image->width);
+	write_u16_le(output, image->height);
+	output.push_back(image->bytes_per_pixel * 8);
+	output.push_back(TGA_ORIGIN_TOP | (has_alpha ? 8 : 0));
+
+	if(has_palette)
+	{
+		for(int i = 0; i < 256; i++)
+		{
+			output.push_back(image->color(i).blue());
+			output.push_back(image->color(i).green());
+			output.push_back(image->color(i).red());
+		}
+	}
+
+	for(uint32_t y = 0; y < image->height; y++)
+	{
+		const uint8_t * row = image->pixels.get() + static_cast<size_t>(image->scanline) * y;
+		output.insert(output.end(), row, row + row_size);
+	}
+}
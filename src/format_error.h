@@ -0,0 +1,19 @@
+#pragma once
+
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+
+/// Error in structure of input data, such as invalid header field or read beyond end of data
+class format_error : public std::runtime_error
+{
+public:
+	using std::runtime_error::runtime_error;
+};
+
+/// Checks invariant of input data. Unlike assert, check is done in all builds, so malformed data never causes undefined behavior
+#define CHECK_FORMAT(condition) \
+	do { \
+		if(!(condition)) \
+			throw format_error(std::string("check '" #condition "' failed at ") + std::filesystem::path(__FILE__).filename().string() + ":" + std::to_string(__LINE__)); \
+	} while(0)
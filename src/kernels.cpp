@@ -0,0 +1,234 @@
+#include "kernels.h"
+
+#include <array>
+#include <cstdio>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define KERNELS_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#include <immintrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+namespace
+{
+	struct cpu_features
+	{
+		bool sse2 = false;
+		bool avx2 = false;
+		bool avx512f = false;
+	};
+
+	struct kernel_tables
+	{
+		std::array<kernels::kernel_set, 3> sets;
+		std::array<bool, 3> compiled = {};
+	};
+}
+
+static const char * get_isa_name(kernels::isa level)
+{
+	switch(level)
+	{
+		case kernels::isa::sse2:
+			return "sse2";
+		case kernels::isa::avx2:
+			return "avx2";
+		default:
+			return "scalar";
+	}
+}
+
+#ifdef KERNELS_X86
+static void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t * registers)
+{
+#ifdef _MSC_VER
+	int result[4];
+	__cpuidex(result, leaf, subleaf);
+	for(int i = 0; i < 4; ++i)
+		registers[i] = result[i];
+#else
+	__cpuid_count(leaf, subleaf, registers[0], registers[1], registers[2], registers[3]);
+#endif
+}
+
+// state components that operating system saves on context switch
+static uint64_t xgetbv()
+{
+#ifdef _MSC_VER
+	return _xgetbv(0);
+#else
+	uint32_t low;
+	uint32_t high;
+	__asm__("xgetbv" : "=a"(low), "=d"(high) : "c"(0));
+	return low | uint64_t(high) << 32;
+#endif
+}
+#endif
+
+// AVX registers can be used only if operating system preserves them, which is reported through OSXSAVE and XCR0
+static cpu_features read_cpu_features()
+{
+	cpu_features features;
+
+#ifdef KERNELS_X86
+	uint32_t registers[4];
+
+	cpuid(0, 0, registers);
+	uint32_t max_leaf = registers[0];
+
+	if(max_leaf < 1)
+		return features;
+
+	cpuid(1, 0, registers);
+	features.sse2 = registers[3] & (1u << 26);
+
+	bool has_xsave = registers[2] & (1u << 27);
+	bool has_avx = registers[2] & (1u << 28);
+
+	if(max_leaf < 7 || !has_xsave || !has_avx)
+		return features;
+
+	uint64_t state = xgetbv();
+	bool avx_state = (state & 0x6) == 0x6;
+	bool avx512_state = (state & 0xe6) == 0xe6;
+
+	cpuid(7, 0, registers);
+	features.avx2 = avx_state && (registers[1] & (1u << 5));
+	features.avx512f = avx512_state && (registers[1] & (1u << 16));
+#endif
+
+	return features;
+}
+
+static const cpu_features & get_cpu_features()
+{
+	static const cpu_features features = read_cpu_features();
+	return features;
+}
+
+static const kernel_tables & get_tables()
+{
+	static const kernel_tables tables = []()
+	{
+		kernel_tables result;
+
+		kernels::add_scalar(result.sets[0]);
+		result.compiled[0] = true;
+
+		result.sets[1] = result.sets[0];
+		result.compiled[1] = kernels::add_sse2(result.sets[1]);
+
+		result.sets[2] = result.sets[1];
+		result.compiled[2] = kernels::add_avx2(result.sets[2]);
+
+		return result;
+	}();
+	return tables;
+}
+
+static bool is_supported(kernels::isa level)
+{
+	switch(level)
+	{
+		case kernels::isa::sse2:
+			return get_tables().compiled[1] && get_cpu_features().sse2;
+		case kernels::isa::avx2:
+			return get_tables().compiled[2] && get_cpu_features().avx2;
+		default:
+			return true;
+	}
+}
+
+static kernels::isa & selected_isa()
+{
+	static kernels::isa value = kernels::detect();
+	return value;
+}
+
+kernels::isa kernels::detect()
+{
+	if(is_supported(isa::avx2))
+		return isa::avx2;
+	if(is_supported(isa::sse2))
+		return isa::sse2;
+	return isa::scalar;
+}
+
+const kernels::kernel_set & kernels::get(isa level)
+{
+	return get_tables().sets[static_cast<size_t>(level)];
+}
+
+const kernels::kernel_set & kernels::active()
+{
+	return get(selected_isa());
+}
+
+kernels::isa kernels::active_isa()
+{
+	return selected_isa();
+}
+
+bool kernels::select(const std::string & name)
+{
+	if(name == "auto")
+	{
+		selected_isa() = detect();
+		return true;
+	}
+
+	for(isa level : { isa::scalar, isa::sse2, isa::avx2 })
+	{
+		if(name != get_isa_name(level))
+			continue;
+
+		if(!is_supported(level))
+			return false;
+
+		selected_isa() = level;
+		return true;
+	}
+	return false;
+}
+
+// Kernel is reported with lowest instruction set that provides it, since sets keep kernels of previous ones
+template<typename Function>
+static const char * get_kernel_isa(Function kernels::kernel_set::* kernel, kernels::isa level)
+{
+	const auto & sets = get_tables().sets;
+
+	for(size_t i = static_cast<size_t>(level); i > 0; --i)
+		if(sets[i].*kernel != sets[i - 1].*kernel)
+			return get_isa_name(static_cast<kernels::isa>(i));
+	return get_isa_name(kernels::isa::scalar);
+}
+
+void kernels::report()
+{
+	const auto & features = get_cpu_features();
+	isa level = active_isa();
+
+	printf("processor:%s%s%s\n", features.sse2 ? " sse2" : "", features.avx2 ? " avx2" : "", features.avx512f ? " avx512f" : "");
+
+	printf("compiled:");
+	for(isa compiled : { isa::scalar, isa::sse2, isa::avx2 })
+		if(get_tables().compiled[static_cast<size_t>(compiled)])
+			printf(" %s", get_isa_name(compiled));
+	printf("\n");
+
+	printf("active: %s\n", get_isa_name(level));
+
+	printf("  %-28s %s\n", "is_row_opaque", get_kernel_isa(&kernel_set::is_row_opaque, level));
+	printf("  %-28s %s\n", "repack_row_rgba_to_rgb", get_kernel_isa(&kernel_set::repack_row_rgba_to_rgb, level));
+	printf("  %-28s %s\n", "expand_row_indexed_to_rgba", get_kernel_isa(&kernel_set::expand_row_indexed_to_rgba, level));
+	printf("  %-28s %s\n", "find_run_end", get_kernel_isa(&kernel_set::find_run_end, level));
+	printf("  %-28s %s\n", "decode_def_row_1", get_kernel_isa(&kernel_set::decode_def_row_1, level));
+	printf("  %-28s %s\n", "decode_def_row_3", get_kernel_isa(&kernel_set::decode_def_row_3, level));
+	printf("  %-28s %s\n", "decode_dxt1_blocks", get_kernel_isa(&kernel_set::decode_dxt1_blocks, level));
+	printf("  %-28s %s\n", "decode_dxt5_blocks", get_kernel_isa(&kernel_set::decode_dxt5_blocks, level));
+	printf("  %-28s %s\n", "transpose", get_kernel_isa(&kernel_set::transpose, level));
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Hot loops of decoders and encoders, with one implementation per instruction set. Scalar implementations are reference
+// ones - every other implementation must give exactly same result for any input. Implementations for other instruction
+// sets are compiled in their own translation units with matching compiler flags, and are selected at startup from cpuid
+namespace kernels
+{
+	enum class isa
+	{
+		scalar,
+		sse2,
+		avx2
+	};
+
+	// returned by decoders of def rows if segments are outside of row or of data
+	constexpr size_t decode_error = SIZE_MAX;
+
+	struct kernel_set
+	{
+		// true if alpha of every pixel in row of rgba32 pixels is 0xff
+		bool (*is_row_opaque)(const uint8_t * row, uint32_t width);
+
+		// rgba32 row into rgb24 row
+		void (*repack_row_rgba_to_rgb)(const uint8_t * source, uint8_t * target, uint32_t width);
+
+		// row of palette indices into rgba32 row, using table with one packed pixel per palette entry
+		void (*expand_row_indexed_to_rgba)(const uint8_t * source, uint8_t * target, uint32_t width, const uint32_t * lookup);
+
+		// position of first byte in [begin + 1, end) that differs from byte at position begin, or end
+		uint32_t (*find_run_end)(const uint8_t * row, uint32_t begin, uint32_t end);
+
+		// row of def frame in format 1 (2-byte segments) or in formats 2 and 3 (1-byte segments).
+		// Returns number of bytes of data used by row, or decode_error
+		size_t (*decode_def_row_1)(const uint8_t * data, size_t size, uint8_t * row, uint32_t width);
+		size_t (*decode_def_row_3)(const uint8_t * data, size_t size, uint8_t * row, uint32_t width);
+
+		// row of DXT1 or DXT5 blocks into 4 rgba32 rows, stride bytes apart. Alpha of DXT1 pixels is 0xff
+		void (*decode_dxt1_blocks)(const uint8_t * blocks, uint32_t count, uint8_t * target, size_t stride);
+		void (*decode_dxt5_blocks)(const uint8_t * blocks, uint32_t count, uint8_t * target, size_t stride);
+
+		// writes pixel (x, y) of source into pixel (y, x) of target
+		void (*transpose)(const uint8_t * source, size_t source_stride, uint8_t * target, size_t target_stride, uint32_t width, uint32_t height, uint32_t bytes_per_pixel);
+	};
+
+	// Every set replaces kernels that it implements, and keeps kernels of previous one for everything else.
+	// Sets for instruction sets that were not compiled in return false
+	void add_scalar(kernel_set & set);
+	bool add_sse2(kernel_set & set);
+	bool add_avx2(kernel_set & set);
+
+	// best instruction set that is supported by both build and processor
+	isa detect();
+
+	// kernels for given instruction set, and all below it
+	const kernel_set & get(isa level);
+
+	// kernels that are used by all decoders and encoders
+	const kernel_set & active();
+	isa active_isa();
+
+	// selects kernels by name of instruction set, fails if it is unknown or not supported
+	bool select(const std::string & name);
+
+	// prints processor features and instruction set of every active kernel
+	void report();
+
+	// compares kernels of every supported instruction set against scalar ones on random data, returns number of mismatches
+	size_t self_check();
+}
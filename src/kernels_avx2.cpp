@@ -0,0 +1,286 @@
+#include "kernels.h"
+#include "kernels_common.h"
+
+// AVX2 implementations of kernels. Compiled with -mavx2, so nothing from this file may be called before checking
+// that processor supports AVX2
+
+#if defined(__AVX2__)
+
+#include <cstring>
+#include <immintrin.h>
+
+static bool is_row_opaque(const uint8_t * row, uint32_t width)
+{
+	uint32_t x = 0;
+
+	// check 32 pixels per iteration - all alpha bytes must stay 0xff after combining 4 vectors
+	const __m256i alpha_mask = _mm256_set1_epi32(static_cast<int>(0xff000000));
+	for(; x + 32 <= width; x += 32)
+	{
+		const __m256i * pixels = reinterpret_cast<const __m256i *>(row + x * 4);
+		__m256i combined = _mm256_and_si256(
+			_mm256_and_si256(_mm256_loadu_si256(pixels + 0), _mm256_loadu_si256(pixels + 1)),
+			_mm256_and_si256(_mm256_loadu_si256(pixels + 2), _mm256_loadu_si256(pixels + 3))
+		);
+		__m256i alpha = _mm256_and_si256(combined, alpha_mask);
+
+		if(static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi32(alpha, alpha_mask))) != 0xffffffff)
+			return false;
+	}
+
+	for(; x < width; ++x)
+		if(row[x * 4 + 3] != 0xff)
+			return false;
+	return true;
+}
+
+static void repack_row_rgba_to_rgb(const uint8_t * src, uint8_t * dst, uint32_t width)
+{
+	uint32_t x = 0;
+
+	// 8 pixels per iteration - drop alpha within each half of vector, then move 12 bytes of upper half next to lower one.
+	// Every store writes 32 bytes while advancing only by 24, so last groups are left to scalar loop
+	const __m256i drop_alpha = _mm256_setr_epi8(
+		0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+		0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1
+	);
+	const __m256i join_halves = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+
+	for(; x + 11 <= width; x += 8)
+	{
+		__m256i pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + x * 4));
+		__m256i packed = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(pixels, drop_alpha), join_halves);
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + x * 3), packed);
+	}
+
+	for(; x < width; ++x)
+	{
+		dst[x * 3 + 0] = src[x * 4 + 0];
+		dst[x * 3 + 1] = src[x * 4 + 1];
+		dst[x * 3 + 2] = src[x * 4 + 2];
+	}
+}
+
+static void expand_row_indexed_to_rgba(const uint8_t * src, uint8_t * dst, uint32_t width, const uint32_t * lookup)
+{
+	uint32_t x = 0;
+
+	// 8 pixels per iteration - widen indices to 32 bits and gather pixels from lookup table
+	for(; x + 8 <= width; x += 8)
+	{
+		__m256i indices = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(src + x)));
+		__m256i pixels = _mm256_i32gather_epi32(reinterpret_cast<const int *>(lookup), indices, 4);
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + x * 4), pixels);
+	}
+
+	for(; x < width; ++x)
+		std::memcpy(dst + x * 4, lookup + src[x], 4);
+}
+
+static uint32_t find_run_end(const uint8_t * row, uint32_t begin, uint32_t end)
+{
+	uint8_t value = row[begin];
+	uint32_t x = begin + 1;
+
+	// compare 32 bytes per iteration, first mismatch is lowest zero bit of comparison mask
+	const __m256i pattern = _mm256_set1_epi8(static_cast<char>(value));
+	for(; x + 32 <= end; x += 32)
+	{
+		uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(row + x)), pattern));
+		if(mask != 0xffffffff)
+			return x + kernels::count_trailing_zeros(~mask);
+	}
+
+	while(x < end && row[x] == value)
+		++x;
+	return x;
+}
+
+// Segments are written in whole vectors whenever rest of row is long enough. Bytes written past end of segment are
+// overwritten by following segments, since every row must be covered by segments completely
+static void fill_segment(uint8_t * row, uint32_t available, uint8_t value, uint32_t length)
+{
+	uint32_t rounded = (length + 31) & ~31u;
+
+	if(rounded > available)
+	{
+		std::memset(row, value, length);
+		return;
+	}
+
+	const __m256i pattern = _mm256_set1_epi8(static_cast<char>(value));
+	for(uint32_t i = 0; i < rounded; i += 32)
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(row + i), pattern);
+}
+
+static void copy_segment(uint8_t * row, uint32_t available, const uint8_t * data, size_t data_available, uint32_t length)
+{
+	uint32_t rounded = (length + 31) & ~31u;
+
+	if(rounded > available || rounded > data_available)
+	{
+		std::memcpy(row, data, length);
+		return;
+	}
+
+	for(uint32_t i = 0; i < rounded; i += 32)
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(row + i), _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i)));
+}
+
+static size_t decode_def_row_1(const uint8_t * data, size_t size, uint8_t * row, uint32_t width)
+{
+	size_t position = 0;
+
+	for(uint32_t x = 0; x < width;)
+	{
+		if(size - position < 2)
+			return kernels::decode_error;
+
+		uint8_t segment_type = data[position];
+		uint32_t segment_length = data[position + 1] + 1;
+		position += 2;
+
+		if(segment_length > width - x)
+			return kernels::decode_error;
+
+		if(segment_type == 0xff)
+		{
+			if(size - position < segment_length)
+				return kernels::decode_error;
+
+			copy_segment(row + x, width - x, data + position, size - position, segment_length);
+			position += segment_length;
+		}
+		else
+		{
+			fill_segment(row + x, width - x, segment_type, segment_length);
+		}
+		x += segment_length;
+	}
+	return position;
+}
+
+static size_t decode_def_row_3(const uint8_t * data, size_t size, uint8_t * row, uint32_t width)
+{
+	size_t position = 0;
+
+	for(uint32_t x = 0; x < width;)
+	{
+		if(size == position)
+			return kernels::decode_error;
+
+		uint8_t segment_type = data[position] / 32;
+		uint32_t segment_length = (data[position] & 31) + 1;
+		position += 1;
+
+		if(segment_length > width - x)
+			return kernels::decode_error;
+
+		if(segment_type == 7)
+		{
+			if(size - position < segment_length)
+				return kernels::decode_error;
+
+			copy_segment(row + x, width - x, data + position, size - position, segment_length);
+			position += segment_length;
+		}
+		else
+		{
+			fill_segment(row + x, width - x, segment_type, segment_length);
+		}
+		x += segment_length;
+	}
+	return position;
+}
+
+// Pixels of block are picked from palette by variable permutation, 8 pixels (2 rows of block) per vector.
+// Palette of 4 colors is repeated in both halves of vector, so 2-bit indices select from it directly
+static void store_dxt_rows(uint8_t * target, size_t stride, __m256i rows01, __m256i rows23)
+{
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(target + 0 * stride), _mm256_castsi256_si128(rows01));
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(target + 1 * stride), _mm256_extracti128_si256(rows01, 1));
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(target + 2 * stride), _mm256_castsi256_si128(rows23));
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(target + 3 * stride), _mm256_extracti128_si256(rows23, 1));
+}
+
+static void decode_dxt1_blocks(const uint8_t * blocks, uint32_t count, uint8_t * target, size_t stride)
+{
+	const __m256i shifts = _mm256_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14);
+	const __m256i index_mask = _mm256_set1_epi32(0x3);
+
+	for(uint32_t i = 0; i < count; ++i)
+	{
+		const uint8_t * block = blocks + i * 8;
+
+		uint32_t colors[4];
+		kernels::get_dxt_colors(block, colors);
+
+		uint32_t lookup_table;
+		std::memcpy(&lookup_table, block + 4, 4);
+
+		__m256i palette = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(colors)));
+		__m256i indices01 = _mm256_and_si256(_mm256_srlv_epi32(_mm256_set1_epi32(static_cast<int>(lookup_table)), shifts), index_mask);
+		__m256i indices23 = _mm256_and_si256(_mm256_srlv_epi32(_mm256_set1_epi32(static_cast<int>(lookup_table >> 16)), shifts), index_mask);
+
+		store_dxt_rows(target + i * 16, stride, _mm256_permutevar8x32_epi32(palette, indices01), _mm256_permutevar8x32_epi32(palette, indices23));
+	}
+}
+
+static void decode_dxt5_blocks(const uint8_t * blocks, uint32_t count, uint8_t * target, size_t stride)
+{
+	const __m256i shifts_c = _mm256_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14);
+	const __m256i shifts_a = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+	const __m256i index_mask_c = _mm256_set1_epi32(0x3);
+	const __m256i index_mask_a = _mm256_set1_epi32(0x7);
+	const __m256i color_mask = _mm256_set1_epi32(0x00ffffff);
+
+	for(uint32_t i = 0; i < count; ++i)
+	{
+		const uint8_t * block = blocks + i * 16;
+
+		uint32_t alphas[8];
+		kernels::get_dxt_alphas(block, alphas);
+		uint64_t lookup_table_a = kernels::get_dxt_alpha_indices(block);
+
+		uint32_t colors[4];
+		kernels::get_dxt_colors(block + 8, colors);
+
+		uint32_t lookup_table_c;
+		std::memcpy(&lookup_table_c, block + 12, 4);
+
+		__m256i palette_c = _mm256_and_si256(_mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(colors))), color_mask);
+		__m256i palette_a = _mm256_slli_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(alphas)), 24);
+
+		__m256i indices01_c = _mm256_and_si256(_mm256_srlv_epi32(_mm256_set1_epi32(static_cast<int>(lookup_table_c)), shifts_c), index_mask_c);
+		__m256i indices23_c = _mm256_and_si256(_mm256_srlv_epi32(_mm256_set1_epi32(static_cast<int>(lookup_table_c >> 16)), shifts_c), index_mask_c);
+		__m256i indices01_a = _mm256_and_si256(_mm256_srlv_epi32(_mm256_set1_epi32(static_cast<int>(lookup_table_a)), shifts_a), index_mask_a);
+		__m256i indices23_a = _mm256_and_si256(_mm256_srlv_epi32(_mm256_set1_epi32(static_cast<int>(lookup_table_a >> 24)), shifts_a), index_mask_a);
+
+		__m256i rows01 = _mm256_or_si256(_mm256_permutevar8x32_epi32(palette_c, indices01_c), _mm256_permutevar8x32_epi32(palette_a, indices01_a));
+		__m256i rows23 = _mm256_or_si256(_mm256_permutevar8x32_epi32(palette_c, indices23_c), _mm256_permutevar8x32_epi32(palette_a, indices23_a));
+
+		store_dxt_rows(target + i * 16, stride, rows01, rows23);
+	}
+}
+
+bool kernels::add_avx2(kernel_set & set)
+{
+	set.is_row_opaque = is_row_opaque;
+	set.repack_row_rgba_to_rgb = repack_row_rgba_to_rgb;
+	set.expand_row_indexed_to_rgba = expand_row_indexed_to_rgba;
+	set.find_run_end = find_run_end;
+	set.decode_def_row_1 = decode_def_row_1;
+	set.decode_def_row_3 = decode_def_row_3;
+	set.decode_dxt1_blocks = decode_dxt1_blocks;
+	set.decode_dxt5_blocks = decode_dxt5_blocks;
+	return true;
+}
+
+#else
+
+bool kernels::add_avx2(kernel_set &)
+{
+	return false;
+}
+
+#endif
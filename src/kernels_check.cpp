@@ -0,0 +1,282 @@
+#include "kernels.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+// Every kernel is called with same random input through scalar and tested implementation, and both results must match.
+// Output buffers are larger than needed and prefilled, so writes past end of output are detected as well
+
+static constexpr size_t guard_size = 64;
+static constexpr uint8_t guard_value = 0xcd;
+
+using random_engine = std::mt19937;
+
+static uint32_t random_in(random_engine & random, uint32_t low, uint32_t high)
+{
+	return std::uniform_int_distribution<uint32_t>(low, high)(random);
+}
+
+static std::vector<uint8_t> random_bytes(random_engine & random, size_t size)
+{
+	std::vector<uint8_t> result(size);
+	for(auto & value : result)
+		value = static_cast<uint8_t>(random());
+	return result;
+}
+
+static std::vector<uint8_t> output_buffer(size_t size)
+{
+	return std::vector<uint8_t>(size + guard_size, guard_value);
+}
+
+static size_t check_is_row_opaque(const kernels::kernel_set & reference, const kernels::kernel_set & tested, random_engine & random)
+{
+	size_t mismatches = 0;
+
+	for(uint32_t width = 0; width < 200; ++width)
+	{
+		for(uint32_t variant = 0; variant < 8; ++variant)
+		{
+			// misaligned start of row, mostly opaque pixels with at most one translucent one
+			uint32_t shift = random_in(random, 0, 3);
+			auto buffer = random_bytes(random, width * 4 + shift);
+			uint8_t * row = buffer.data() + shift;
+
+			for(uint32_t x = 0; x < width; ++x)
+				row[x * 4 + 3] = 0xff;
+
+			if(width > 0 && variant % 2 == 1)
+				row[random_in(random, 0, width - 1) * 4 + 3] = static_cast<uint8_t>(random_in(random, 0, 0xfe));
+
+			if(reference.is_row_opaque(row, width) != tested.is_row_opaque(row, width))
+				mismatches += 1;
+		}
+	}
+	return mismatches;
+}
+
+static size_t check_repack_row_rgba_to_rgb(const kernels::kernel_set & reference, const kernels::kernel_set & tested, random_engine & random)
+{
+	size_t mismatches = 0;
+
+	for(uint32_t width = 0; width < 200; ++width)
+	{
+		auto source = random_bytes(random, width * 4);
+		auto expected = output_buffer(width * 3);
+		auto actual = output_buffer(width * 3);
+
+		reference.repack_row_rgba_to_rgb(source.data(), expected.data(), width);
+		tested.repack_row_rgba_to_rgb(source.data(), actual.data(), width);
+
+		if(expected != actual)
+			mismatches += 1;
+	}
+	return mismatches;
+}
+
+static size_t check_expand_row_indexed_to_rgba(const kernels::kernel_set & reference, const kernels::kernel_set & tested, random_engine & random)
+{
+	size_t mismatches = 0;
+
+	std::vector<uint32_t> lookup(256);
+	for(auto & value : lookup)
+		value = random();
+
+	for(uint32_t width = 0; width < 200; ++width)
+	{
+		auto source = random_bytes(random, width);
+		auto expected = output_buffer(width * 4);
+		auto actual = output_buffer(width * 4);
+
+		reference.expand_row_indexed_to_rgba(source.data(), expected.data(), width, lookup.data());
+		tested.expand_row_indexed_to_rgba(source.data(), actual.data(), width, lookup.data());
+
+		if(expected != actual)
+			mismatches += 1;
+	}
+	return mismatches;
+}
+
+static size_t check_find_run_end(const kernels::kernel_set & reference, const kernels::kernel_set & tested, random_engine & random)
+{
+	size_t mismatches = 0;
+
+	for(uint32_t test = 0; test < 2000; ++test)
+	{
+		// runs of few different values, so long runs and all positions of their ends are covered
+		std::vector<uint8_t> row;
+		uint32_t size = random_in(random, 1, 300);
+		while(row.size() < size)
+			row.insert(row.end(), random_in(random, 1, 70), static_cast<uint8_t>(random_in(random, 0, 2)));
+		row.resize(size);
+
+		uint32_t begin = random_in(random, 0, size - 1);
+		uint32_t end = random_in(random, begin + 1, size);
+
+		if(reference.find_run_end(row.data(), begin, end) != tested.find_run_end(row.data(), begin, end))
+			mismatches += 1;
+	}
+	return mismatches;
+}
+
+// Random segments that cover whole row, with damaged or truncated data in some of tests
+static std::vector<uint8_t> random_def_row(random_engine & random, uint32_t width, bool format_1)
+{
+	std::vector<uint8_t> data;
+
+	for(uint32_t x = 0; x < width;)
+	{
+		uint32_t length = std::min(width - x, random_in(random, 1, format_1 ? 256 : 32));
+		bool literal = random_in(random, 0, 2) == 0;
+
+		if(format_1)
+		{
+			data.push_back(literal ? 0xff : static_cast<uint8_t>(random_in(random, 0, 0xfe)));
+			data.push_back(static_cast<uint8_t>(length - 1));
+		}
+		else
+		{
+			data.push_back(static_cast<uint8_t>((literal ? 7 : random_in(random, 0, 6)) * 32 + length - 1));
+		}
+
+		if(literal)
+		{
+			auto pixels = random_bytes(random, length);
+			data.insert(data.end(), pixels.begin(), pixels.end());
+		}
+		x += length;
+	}
+
+	switch(random_in(random, 0, 7))
+	{
+		case 0:
+			if(!data.empty())
+				data[random_in(random, 0, data.size() - 1)] = static_cast<uint8_t>(random());
+			break;
+		case 1:
+			data.resize(random_in(random, 0, data.size()));
+			break;
+		default:
+			break;
+	}
+
+	// data of following rows
+	auto trailing = random_bytes(random, random_in(random, 0, 40));
+	data.insert(data.end(), trailing.begin(), trailing.end());
+	return data;
+}
+
+static size_t check_decode_def_row(const kernels::kernel_set & reference, const kernels::kernel_set & tested, random_engine & random, bool format_1)
+{
+	size_t mismatches = 0;
+	auto decode_reference = format_1 ? reference.decode_def_row_1 : reference.decode_def_row_3;
+	auto decode_tested = format_1 ? tested.decode_def_row_1 : tested.decode_def_row_3;
+
+	for(uint32_t test = 0; test < 2000; ++test)
+	{
+		uint32_t width = random_in(random, 1, 300);
+		auto data = random_def_row(random, width, format_1);
+		auto expected = output_buffer(width);
+		auto actual = output_buffer(width);
+
+		size_t expected_size = decode_reference(data.data(), data.size(), expected.data(), width);
+		size_t actual_size = decode_tested(data.data(), data.size(), actual.data(), width);
+
+		// content of row after error is not defined, since it is never used
+		if(expected_size != actual_size || (expected_size != kernels::decode_error && expected != actual))
+			mismatches += 1;
+	}
+	return mismatches;
+}
+
+static size_t check_decode_dxt_blocks(const kernels::kernel_set & reference, const kernels::kernel_set & tested, random_engine & random, bool dxt5)
+{
+	size_t mismatches = 0;
+	auto decode_reference = dxt5 ? reference.decode_dxt5_blocks : reference.decode_dxt1_blocks;
+	auto decode_tested = dxt5 ? tested.decode_dxt5_blocks : tested.decode_dxt1_blocks;
+
+	for(uint32_t test = 0; test < 500; ++test)
+	{
+		uint32_t count = random_in(random, 1, 40);
+		size_t stride = count * 16 + random_in(random, 0, 16);
+
+		auto blocks = random_bytes(random, count * (dxt5 ? 16 : 8));
+		auto expected = output_buffer(stride * 4);
+		auto actual = output_buffer(stride * 4);
+
+		decode_reference(blocks.data(), count, expected.data(), stride);
+		decode_tested(blocks.data(), count, actual.data(), stride);
+
+		if(expected != actual)
+			mismatches += 1;
+	}
+	return mismatches;
+}
+
+static size_t check_transpose(const kernels::kernel_set & reference, const kernels::kernel_set & tested, random_engine & random)
+{
+	size_t mismatches = 0;
+
+	for(uint32_t test = 0; test < 1000; ++test)
+	{
+		uint32_t width = random_in(random, 1, 40);
+		uint32_t height = random_in(random, 1, 40);
+		uint32_t bytes_per_pixel = random_in(random, 1, 4);
+		size_t source_stride = width * bytes_per_pixel + random_in(random, 0, 8);
+		size_t target_stride = height * bytes_per_pixel + random_in(random, 0, 8);
+
+		auto source = random_bytes(random, source_stride * height);
+		auto expected = output_buffer(target_stride * width);
+		auto actual = output_buffer(target_stride * width);
+
+		reference.transpose(source.data(), source_stride, expected.data(), target_stride, width, height, bytes_per_pixel);
+		tested.transpose(source.data(), source_stride, actual.data(), target_stride, width, height, bytes_per_pixel);
+
+		if(expected != actual)
+			mismatches += 1;
+	}
+	return mismatches;
+}
+
+size_t kernels::self_check()
+{
+	const kernel_set & reference = get(isa::scalar);
+	size_t total = 0;
+
+	for(isa level : { isa::sse2, isa::avx2 })
+	{
+		if(static_cast<int>(level) > static_cast<int>(detect()))
+			break;
+
+		const kernel_set & tested = get(level);
+		random_engine random(static_cast<uint32_t>(level));
+
+		struct
+		{
+			const char * name;
+			size_t mismatches;
+		} results[] = {
+			{ "is_row_opaque", check_is_row_opaque(reference, tested, random) },
+			{ "repack_row_rgba_to_rgb", check_repack_row_rgba_to_rgb(reference, tested, random) },
+			{ "expand_row_indexed_to_rgba", check_expand_row_indexed_to_rgba(reference, tested, random) },
+			{ "find_run_end", check_find_run_end(reference, tested, random) },
+			{ "decode_def_row_1", check_decode_def_row(reference, tested, random, true) },
+			{ "decode_def_row_3", check_decode_def_row(reference, tested, random, false) },
+			{ "decode_dxt1_blocks", check_decode_dxt_blocks(reference, tested, random, false) },
+			{ "decode_dxt5_blocks", check_decode_dxt_blocks(reference, tested, random, true) },
+			{ "transpose", check_transpose(reference, tested, random) },
+		};
+
+		printf("checking %s kernels against scalar ones:\n", level == isa::sse2 ? "sse2" : "avx2");
+		for(const auto & result : results)
+		{
+			printf("  %-28s %s\n", result.name, result.mismatches == 0 ? "ok" : (std::to_string(result.mismatches) + " mismatches").c_str());
+			total += result.mismatches;
+		}
+	}
+
+	return total;
+}
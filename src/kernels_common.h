@@ -0,0 +1,87 @@
+#pragma once
+
+// Helpers shared by implementations of kernels. Translation units of kernels are compiled with different instruction
+// sets, so everything here has internal linkage - otherwise linker could pick copy compiled for instruction set
+// that processor does not support
+
+#include <cstdint>
+#include <cstring>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace kernels
+{
+	static inline uint32_t count_trailing_zeros(uint32_t value)
+	{
+#ifdef _MSC_VER
+		unsigned long result;
+		_BitScanForward(&result, value);
+		return result;
+#else
+		return __builtin_ctz(value);
+#endif
+	}
+
+	// Colors of DXT block, as packed pixels with bytes in order of RGB565 components from low bits, and opaque alpha
+	static inline void get_dxt_colors(const uint8_t * block, uint32_t * colors)
+	{
+		uint16_t color0;
+		uint16_t color1;
+		std::memcpy(&color0, block + 0, 2);
+		std::memcpy(&color1, block + 2, 2);
+
+		uint32_t c0[3] = { uint32_t(color0 & 31) << 3, uint32_t((color0 >> 5) & 63) << 2, uint32_t(color0 >> 11) << 3 };
+		uint32_t c1[3] = { uint32_t(color1 & 31) << 3, uint32_t((color1 >> 5) & 63) << 2, uint32_t(color1 >> 11) << 3 };
+		uint32_t c2[3];
+		uint32_t c3[3];
+
+		for(int i = 0; i < 3; ++i)
+		{
+			if(color0 > color1)
+			{
+				c2[i] = c0[i] * 2 / 3 + c1[i] / 3;
+				c3[i] = c0[i] / 3 + c1[i] * 2 / 3;
+			}
+			else
+			{
+				c2[i] = c0[i] / 2 + c1[i] / 2;
+				c3[i] = 0; // black
+			}
+		}
+
+		colors[0] = c0[0] | c0[1] << 8 | c0[2] << 16 | 0xff000000;
+		colors[1] = c1[0] | c1[1] << 8 | c1[2] << 16 | 0xff000000;
+		colors[2] = c2[0] | c2[1] << 8 | c2[2] << 16 | 0xff000000;
+		colors[3] = c3[0] | c3[1] << 8 | c3[2] << 16 | 0xff000000;
+	}
+
+	// Alpha values of DXT5 block
+	static inline void get_dxt_alphas(const uint8_t * block, uint32_t * alpha)
+	{
+		alpha[0] = block[0];
+		alpha[1] = block[1];
+
+		if(alpha[0] > alpha[1])
+		{
+			for(uint32_t i = 1; i < 7; ++i)
+				alpha[i + 1] = (alpha[0] * (7 - i) + alpha[1] * i) / 7;
+		}
+		else
+		{
+			for(uint32_t i = 1; i < 5; ++i)
+				alpha[i + 1] = (alpha[0] * (5 - i) + alpha[1] * i) / 5;
+			alpha[6] = 0;
+			alpha[7] = 255;
+		}
+	}
+
+	// 48 bits of 3-bit alpha indices of DXT5 block
+	static inline uint64_t get_dxt_alpha_indices(const uint8_t * block)
+	{
+		uint64_t result = 0;
+		std::memcpy(&result, block + 2, 6);
+		return result;
+	}
+}
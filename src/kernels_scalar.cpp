@@ -0,0 +1,188 @@
+#include "kernels.h"
+#include "kernels_common.h"
+
+#include <algorithm>
+#include <cstring>
+
+// Reference implementations of kernels, in plain C++
+
+static bool is_row_opaque(const uint8_t * row, uint32_t width)
+{
+	for(uint32_t x = 0; x < width; ++x)
+		if(row[x * 4 + 3] != 0xff)
+			return false;
+	return true;
+}
+
+static void repack_row_rgba_to_rgb(const uint8_t * src, uint8_t * dst, uint32_t width)
+{
+	for(uint32_t x = 0; x < width; ++x)
+	{
+		dst[x * 3 + 0] = src[x * 4 + 0];
+		dst[x * 3 + 1] = src[x * 4 + 1];
+		dst[x * 3 + 2] = src[x * 4 + 2];
+	}
+}
+
+static void expand_row_indexed_to_rgba(const uint8_t * src, uint8_t * dst, uint32_t width, const uint32_t * lookup)
+{
+	for(uint32_t x = 0; x < width; ++x)
+		std::memcpy(dst + x * 4, lookup + src[x], 4);
+}
+
+static uint32_t find_run_end(const uint8_t * row, uint32_t begin, uint32_t end)
+{
+	uint8_t value = row[begin];
+	uint32_t x = begin + 1;
+
+	while(x < end && row[x] == value)
+		++x;
+	return x;
+}
+
+static size_t decode_def_row_1(const uint8_t * data, size_t size, uint8_t * row, uint32_t width)
+{
+	size_t position = 0;
+
+	for(uint32_t x = 0; x < width;)
+	{
+		if(size - position < 2)
+			return kernels::decode_error;
+
+		uint8_t segment_type = data[position];
+		uint32_t segment_length = data[position + 1] + 1;
+		position += 2;
+
+		if(segment_length > width - x)
+			return kernels::decode_error;
+
+		if(segment_type == 0xff)
+		{
+			if(size - position < segment_length)
+				return kernels::decode_error;
+
+			std::memcpy(row + x, data + position, segment_length);
+			position += segment_length;
+		}
+		else
+		{
+			std::memset(row + x, segment_type, segment_length);
+		}
+		x += segment_length;
+	}
+	return position;
+}
+
+static size_t decode_def_row_3(const uint8_t * data, size_t size, uint8_t * row, uint32_t width)
+{
+	size_t position = 0;
+
+	for(uint32_t x = 0; x < width;)
+	{
+		if(size == position)
+			return kernels::decode_error;
+
+		uint8_t segment_type = data[position] / 32;
+		uint32_t segment_length = (data[position] & 31) + 1;
+		position += 1;
+
+		if(segment_length > width - x)
+			return kernels::decode_error;
+
+		if(segment_type == 7)
+		{
+			if(size - position < segment_length)
+				return kernels::decode_error;
+
+			std::memcpy(row + x, data + position, segment_length);
+			position += segment_length;
+		}
+		else
+		{
+			std::memset(row + x, segment_type, segment_length);
+		}
+		x += segment_length;
+	}
+	return position;
+}
+
+static void decode_dxt1_blocks(const uint8_t * blocks, uint32_t count, uint8_t * target, size_t stride)
+{
+	for(uint32_t i = 0; i < count; ++i)
+	{
+		const uint8_t * block = blocks + i * 8;
+
+		uint32_t colors[4];
+		kernels::get_dxt_colors(block, colors);
+
+		uint32_t lookup_table;
+		std::memcpy(&lookup_table, block + 4, 4);
+
+		for(uint32_t y = 0; y < 4; ++y)
+			for(uint32_t x = 0; x < 4; ++x)
+				std::memcpy(target + y * stride + (i * 4 + x) * 4, &colors[(lookup_table >> ((y * 4 + x) * 2)) & 0x3], 4);
+	}
+}
+
+static void decode_dxt5_blocks(const uint8_t * blocks, uint32_t count, uint8_t * target, size_t stride)
+{
+	for(uint32_t i = 0; i < count; ++i)
+	{
+		const uint8_t * block = blocks + i * 16;
+
+		uint32_t alphas[8];
+		kernels::get_dxt_alphas(block, alphas);
+		uint64_t lookup_table_a = kernels::get_dxt_alpha_indices(block);
+
+		uint32_t colors[4];
+		kernels::get_dxt_colors(block + 8, colors);
+
+		uint32_t lookup_table_c;
+		std::memcpy(&lookup_table_c, block + 12, 4);
+
+		for(uint32_t y = 0; y < 4; ++y)
+		{
+			for(uint32_t x = 0; x < 4; ++x)
+			{
+				uint32_t offset = y * 4 + x;
+				uint32_t color = colors[(lookup_table_c >> (offset * 2)) & 0x3];
+				uint32_t alpha = alphas[(lookup_table_a >> (offset * 3)) & 0x7];
+				uint32_t pixel = (color & 0x00ffffff) | alpha << 24;
+
+				std::memcpy(target + y * stride + (i * 4 + x) * 4, &pixel, 4);
+			}
+		}
+	}
+}
+
+// Image is processed in square blocks, so both reads and writes stay within few cache lines
+static void transpose(const uint8_t * source, size_t source_stride, uint8_t * target, size_t target_stride, uint32_t width, uint32_t height, uint32_t bytes_per_pixel)
+{
+	constexpr uint32_t block_size = 16;
+
+	for(uint32_t block_x = 0; block_x < width; block_x += block_size)
+	{
+		for(uint32_t block_y = 0; block_y < height; block_y += block_size)
+		{
+			uint32_t block_x_end = std::min(width, block_x + block_size);
+			uint32_t block_y_end = std::min(height, block_y + block_size);
+
+			for(uint32_t x = block_x; x < block_x_end; ++x)
+				for(uint32_t y = block_y; y < block_y_end; ++y)
+					std::memcpy(target + x * target_stride + y * bytes_per_pixel, source + y * source_stride + x * bytes_per_pixel, bytes_per_pixel);
+		}
+	}
+}
+
+void kernels::add_scalar(kernel_set & set)
+{
+	set.is_row_opaque = is_row_opaque;
+	set.repack_row_rgba_to_rgb = repack_row_rgba_to_rgb;
+	set.expand_row_indexed_to_rgba = expand_row_indexed_to_rgba;
+	set.find_run_end = find_run_end;
+	set.decode_def_row_1 = decode_def_row_1;
+	set.decode_def_row_3 = decode_def_row_3;
+	set.decode_dxt1_blocks = decode_dxt1_blocks;
+	set.decode_dxt5_blocks = decode_dxt5_blocks;
+	set.transpose = transpose;
+}
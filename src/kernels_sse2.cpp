@@ -0,0 +1,254 @@
+#include "kernels.h"
+#include "kernels_common.h"
+
+// SSE2 implementations of kernels. Compiled with -msse2, which is already default for x86-64
+
+#if defined(__SSE2__) || defined(_M_X64)
+
+#include <cstring>
+#include <emmintrin.h>
+
+static bool is_row_opaque(const uint8_t * row, uint32_t width)
+{
+	uint32_t x = 0;
+
+	// check 16 pixels per iteration - all alpha bytes must stay 0xff after combining 4 vectors
+	const __m128i alpha_mask = _mm_set1_epi32(static_cast<int>(0xff000000));
+	for(; x + 16 <= width; x += 16)
+	{
+		const __m128i * pixels = reinterpret_cast<const __m128i *>(row + x * 4);
+		__m128i combined = _mm_and_si128(
+			_mm_and_si128(_mm_loadu_si128(pixels + 0), _mm_loadu_si128(pixels + 1)),
+			_mm_and_si128(_mm_loadu_si128(pixels + 2), _mm_loadu_si128(pixels + 3))
+		);
+		__m128i alpha = _mm_and_si128(combined, alpha_mask);
+
+		if(_mm_movemask_epi8(_mm_cmpeq_epi32(alpha, alpha_mask)) != 0xffff)
+			return false;
+	}
+
+	for(; x < width; ++x)
+		if(row[x * 4 + 3] != 0xff)
+			return false;
+	return true;
+}
+
+static void repack_row_rgba_to_rgb(const uint8_t * src, uint8_t * dst, uint32_t width)
+{
+	uint32_t x = 0;
+
+	// every store writes 16 bytes while advancing only by 12, so last group is left to scalar loop
+	const __m128i lane_mask_0 = _mm_set_epi32(0, 0, 0, 0x00ffffff);
+	const __m128i lane_mask_1 = _mm_set_epi32(0, 0, 0x00ffffff, 0);
+	const __m128i lane_mask_2 = _mm_set_epi32(0, 0x00ffffff, 0, 0);
+	const __m128i lane_mask_3 = _mm_set_epi32(0x00ffffff, 0, 0, 0);
+
+	for(; x + 5 < width; x += 4)
+	{
+		__m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + x * 4));
+
+		__m128i packed = _mm_or_si128(
+			_mm_or_si128(
+				_mm_and_si128(pixels, lane_mask_0),
+				_mm_srli_si128(_mm_and_si128(pixels, lane_mask_1), 1)
+			),
+			_mm_or_si128(
+				_mm_srli_si128(_mm_and_si128(pixels, lane_mask_2), 2),
+				_mm_srli_si128(_mm_and_si128(pixels, lane_mask_3), 3)
+			)
+		);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x * 3), packed);
+	}
+
+	for(; x < width; ++x)
+	{
+		dst[x * 3 + 0] = src[x * 4 + 0];
+		dst[x * 3 + 1] = src[x * 4 + 1];
+		dst[x * 3 + 2] = src[x * 4 + 2];
+	}
+}
+
+static uint32_t find_run_end(const uint8_t * row, uint32_t begin, uint32_t end)
+{
+	uint8_t value = row[begin];
+	uint32_t x = begin + 1;
+
+	// compare 16 bytes per iteration, first mismatch is lowest zero bit of comparison mask
+	const __m128i pattern = _mm_set1_epi8(static_cast<char>(value));
+	for(; x + 16 <= end; x += 16)
+	{
+		uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(row + x)), pattern));
+		if(mask != 0xffff)
+			return x + kernels::count_trailing_zeros(~mask);
+	}
+
+	while(x < end && row[x] == value)
+		++x;
+	return x;
+}
+
+// Segments are written in whole vectors whenever rest of row is long enough. Bytes written past end of segment are
+// overwritten by following segments, since every row must be covered by segments completely
+static void fill_segment(uint8_t * row, uint32_t available, uint8_t value, uint32_t length)
+{
+	uint32_t rounded = (length + 15) & ~15u;
+
+	if(rounded > available)
+	{
+		std::memset(row, value, length);
+		return;
+	}
+
+	const __m128i pattern = _mm_set1_epi8(static_cast<char>(value));
+	for(uint32_t i = 0; i < rounded; i += 16)
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(row + i), pattern);
+}
+
+static void copy_segment(uint8_t * row, uint32_t available, const uint8_t * data, size_t data_available, uint32_t length)
+{
+	uint32_t rounded = (length + 15) & ~15u;
+
+	if(rounded > available || rounded > data_available)
+	{
+		std::memcpy(row, data, length);
+		return;
+	}
+
+	for(uint32_t i = 0; i < rounded; i += 16)
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(row + i), _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i)));
+}
+
+static size_t decode_def_row_1(const uint8_t * data, size_t size, uint8_t * row, uint32_t width)
+{
+	size_t position = 0;
+
+	for(uint32_t x = 0; x < width;)
+	{
+		if(size - position < 2)
+			return kernels::decode_error;
+
+		uint8_t segment_type = data[position];
+		uint32_t segment_length = data[position + 1] + 1;
+		position += 2;
+
+		if(segment_length > width - x)
+			return kernels::decode_error;
+
+		if(segment_type == 0xff)
+		{
+			if(size - position < segment_length)
+				return kernels::decode_error;
+
+			copy_segment(row + x, width - x, data + position, size - position, segment_length);
+			position += segment_length;
+		}
+		else
+		{
+			fill_segment(row + x, width - x, segment_type, segment_length);
+		}
+		x += segment_length;
+	}
+	return position;
+}
+
+static size_t decode_def_row_3(const uint8_t * data, size_t size, uint8_t * row, uint32_t width)
+{
+	size_t position = 0;
+
+	for(uint32_t x = 0; x < width;)
+	{
+		if(size == position)
+			return kernels::decode_error;
+
+		uint8_t segment_type = data[position] / 32;
+		uint32_t segment_length = (data[position] & 31) + 1;
+		position += 1;
+
+		if(segment_length > width - x)
+			return kernels::decode_error;
+
+		if(segment_type == 7)
+		{
+			if(size - position < segment_length)
+				return kernels::decode_error;
+
+			copy_segment(row + x, width - x, data + position, size - position, segment_length);
+			position += segment_length;
+		}
+		else
+		{
+			fill_segment(row + x, width - x, segment_type, segment_length);
+		}
+		x += segment_length;
+	}
+	return position;
+}
+
+static void transpose_pixels(const uint8_t * source, size_t source_stride, uint8_t * target, size_t target_stride, uint32_t x_begin, uint32_t x_end, uint32_t y_begin, uint32_t y_end, uint32_t bytes_per_pixel)
+{
+	for(uint32_t x = x_begin; x < x_end; ++x)
+		for(uint32_t y = y_begin; y < y_end; ++y)
+			std::memcpy(target + x * target_stride + y * bytes_per_pixel, source + y * source_stride + x * bytes_per_pixel, bytes_per_pixel);
+}
+
+// 32-bit pixels are transposed in blocks of 4x4 pixels, one vector per row of block. Other formats and edges of image
+// that do not form complete block are copied pixel by pixel
+static void transpose(const uint8_t * source, size_t source_stride, uint8_t * target, size_t target_stride, uint32_t width, uint32_t height, uint32_t bytes_per_pixel)
+{
+	if(bytes_per_pixel != 4)
+	{
+		transpose_pixels(source, source_stride, target, target_stride, 0, width, 0, height, bytes_per_pixel);
+		return;
+	}
+
+	uint32_t width_blocks = width / 4 * 4;
+	uint32_t height_blocks = height / 4 * 4;
+
+	for(uint32_t y = 0; y < height_blocks; y += 4)
+	{
+		for(uint32_t x = 0; x < width_blocks; x += 4)
+		{
+			const uint8_t * block = source + y * source_stride + x * 4;
+
+			__m128i row0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block + 0 * source_stride));
+			__m128i row1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block + 1 * source_stride));
+			__m128i row2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block + 2 * source_stride));
+			__m128i row3 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block + 3 * source_stride));
+
+			__m128i low01 = _mm_unpacklo_epi32(row0, row1);
+			__m128i low23 = _mm_unpacklo_epi32(row2, row3);
+			__m128i high01 = _mm_unpackhi_epi32(row0, row1);
+			__m128i high23 = _mm_unpackhi_epi32(row2, row3);
+
+			uint8_t * output = target + x * target_stride + y * 4;
+
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(output + 0 * target_stride), _mm_unpacklo_epi64(low01, low23));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(output + 1 * target_stride), _mm_unpackhi_epi64(low01, low23));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(output + 2 * target_stride), _mm_unpacklo_epi64(high01, high23));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(output + 3 * target_stride), _mm_unpackhi_epi64(high01, high23));
+		}
+	}
+
+	transpose_pixels(source, source_stride, target, target_stride, width_blocks, width, 0, height, 4);
+	transpose_pixels(source, source_stride, target, target_stride, 0, width_blocks, height_blocks, height, 4);
+}
+
+bool kernels::add_sse2(kernel_set & set)
+{
+	set.is_row_opaque = is_row_opaque;
+	set.repack_row_rgba_to_rgb = repack_row_rgba_to_rgb;
+	set.find_run_end = find_run_end;
+	set.decode_def_row_1 = decode_def_row_1;
+	set.decode_def_row_3 = decode_def_row_3;
+	set.transpose = transpose;
+	return true;
+}
+
+#else
+
+bool kernels::add_sse2(kernel_set &)
+{
+	return false;
+}
+
+#endif
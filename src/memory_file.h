@@ -8,10 +8,21 @@
 #include <memory>
 #include <string>
 
+#include "format_error.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 class memory_file
 {
 public:
 	memory_file(uint8_t * data, size_t memory_size);
+	memory_file(memory_file & parent, size_t memory_size);
+	memory_file(memory_file & parent, size_t offset, size_t memory_size);
 	memory_file(size_t memory_size);
 	memory_file(const std::string & filename);
 	memory_file(const std::filesystem::path & filename);
@@ -63,11 +74,13 @@ public:
 
 	void skip(size_t count)
 	{
+		check_range(tell(), count);
 		m_data_ptr += count;
 	}
 
 	void set(size_t count)
 	{
+		check_range(count, 0);
 		m_data_ptr = m_data_begin + count;
 	}
 
@@ -86,10 +99,82 @@ public:
 		return m_data_ptr;
 	}
 
+	/// Descriptor of file on disk that contains data of this memory_file, or -1 if data is not backed by a file
+	int source_descriptor() const
+	{
+		return m_mapping ? m_mapping->descriptor : -1;
+	}
+
+	/// Offset of data of this memory_file in source file
+	size_t source_offset() const
+	{
+		assert(m_mapping);
+		return m_data_begin - m_mapping->data;
+	}
+
+	/// Hints OS that specified range will be accessed soon and should be read ahead from disk
+	void advise_willneed(size_t offset, size_t size)
+	{
+#ifndef _WIN32
+		if(!m_mapping || size == 0)
+			return;
+
+		uintptr_t page_size = sysconf(_SC_PAGESIZE);
+		uintptr_t begin = reinterpret_cast<uintptr_t>(m_data_begin + offset) / page_size * page_size;
+		uintptr_t end = reinterpret_cast<uintptr_t>(m_data_begin + offset + size);
+		madvise(reinterpret_cast<void *>(begin), end - begin, MADV_WILLNEED);
+#else
+		(void)offset;
+		(void)size;
+#endif
+	}
+
+	/// Hints OS that specified range is no longer needed. Only pages that are fully within range are released
+	void advise_dontneed(size_t offset, size_t size)
+	{
+#ifndef _WIN32
+		if(!m_mapping || size == 0)
+			return;
+
+		uintptr_t page_size = sysconf(_SC_PAGESIZE);
+		uintptr_t begin = (reinterpret_cast<uintptr_t>(m_data_begin + offset) + page_size - 1) / page_size * page_size;
+		uintptr_t end = reinterpret_cast<uintptr_t>(m_data_begin + offset + size) / page_size * page_size;
+		if(begin < end)
+			madvise(reinterpret_cast<void *>(begin), end - begin, MADV_DONTNEED);
+#else
+		(void)offset;
+		(void)size;
+#endif
+	}
+
 private:
+	/// Archive memory-mapped from disk, shared between memory_file and all views into it
+	struct file_mapping
+	{
+		int descriptor = -1;
+		uint8_t * data = nullptr;
+		size_t size = 0;
+
+		~file_mapping()
+		{
+#ifndef _WIN32
+			munmap(data, size);
+			close(descriptor);
+#endif
+		}
+	};
+
+	/// Throws format_error if range at specified offset does not fit into data
+	void check_range(size_t offset, size_t count) const
+	{
+		size_t data_size = m_data_end - m_data_begin;
+		if(offset > data_size || count > data_size - offset)
+			throw format_error("range of " + std::to_string(count) + " bytes at offset " + std::to_string(offset) + " is beyond end of data of size " + std::to_string(data_size));
+	}
+
 	void peek_n(uint8_t * ptr, size_t count) const
 	{
-		assert(m_data_ptr + count <= m_data_end);
+		check_range(m_data_ptr - m_data_begin, count);
 		std::copy_n(m_data_ptr, count, ptr);
 	}
 
@@ -101,12 +186,13 @@ private:
 
 	void write_n(const uint8_t * ptr, size_t count)
 	{
-		assert(m_data_ptr + count <= m_data_end);
+		check_range(m_data_ptr - m_data_begin, count);
 		std::copy_n(ptr, count, m_data_ptr);
 		m_data_ptr += count;
 	}
 
 	std::unique_ptr<uint8_t[]> m_data_storage;
+	std::shared_ptr<file_mapping> m_mapping;
 	uint8_t * m_data_begin;
 	uint8_t * m_data_ptr;
 	uint8_t * m_data_end;
@@ -120,6 +206,24 @@ inline memory_file::memory_file(uint8_t * data, size_t memory_size)
 {
 }
 
+/// Creates view into content of parent file, starting from its current position
+inline memory_file::memory_file(memory_file & parent, size_t memory_size)
+	: memory_file(parent, parent.tell(), memory_size)
+{
+}
+
+/// Creates view into content of parent file, starting from specified offset. Position of parent file is not changed
+inline memory_file::memory_file(memory_file & parent, size_t offset, size_t memory_size)
+	: m_data_storage(nullptr)
+	, m_mapping(parent.m_mapping)
+{
+	parent.check_range(offset, memory_size);
+
+	m_data_begin = parent.m_data_begin + offset;
+	m_data_ptr = m_data_begin;
+	m_data_end = m_data_begin + memory_size;
+}
+
 inline memory_file::memory_file(size_t memory_size)
 	: m_data_storage(new uint8_t[memory_size])
 	, m_data_begin(m_data_storage.get())
@@ -129,46 +233,18 @@ inline memory_file::memory_file(size_t memory_size)
 }
 
 inline memory_file::memory_file(const std::string & filename)
+	: memory_file(std::filesystem::path(filename))
 {
-#ifdef _MSC_VER
-	FILE * file_ptr;
-	fopen_s(&file_ptr, filename.c_str(), "rb");
-#else
-	FILE * file_ptr = fopen(filename.c_str(), "rb");
-#endif
-	assert(file_ptr != nullptr);
-	fseek(file_ptr, 0, SEEK_END);
-#ifdef _MSC_VER
-	auto fsize = _ftelli64(file_ptr);
-#else
-	auto fsize = ftell(file_ptr);
-#endif
-	assert(fsize > 0);
-	fseek(file_ptr, 0, SEEK_SET);
-
-	m_data_storage.reset(new uint8_t[fsize]);
-	m_data_begin = m_data_storage.get();
-	m_data_ptr = m_data_storage.get();
-	m_data_end = m_data_storage.get() + fsize;
-	fread(m_data_storage.get(), sizeof(uint8_t), fsize, file_ptr);
-	fclose(file_ptr);
 }
 
 inline memory_file::memory_file(const std::filesystem::path & filename)
 {
-#ifdef _MSC_VER
+#ifdef _WIN32
 	FILE * file_ptr;
 	_wfopen_s(&file_ptr, filename.native().c_str(), L"rb");
-#else
-	FILE * file_ptr = fopen(filename.c_str(), "rb");
-#endif
 	assert(file_ptr != nullptr);
 	fseek(file_ptr, 0, SEEK_END);
-#ifdef _MSC_VER
 	auto fsize = _ftelli64(file_ptr);
-#else
-	auto fsize = ftell(file_ptr);
-#endif
 	assert(fsize > 0);
 	fseek(file_ptr, 0, SEEK_SET);
 
@@ -176,7 +252,26 @@ inline memory_file::memory_file(const std::filesystem::path & filename)
 	m_data_begin = m_data_storage.get();
 	m_data_ptr = m_data_storage.get();
 	m_data_end = m_data_storage.get() + fsize;
-	int read_size = fread(m_data_storage.get(), sizeof(uint8_t), fsize, file_ptr);
+	[[maybe_unused]] auto read_size = fread(m_data_storage.get(), sizeof(uint8_t), fsize, file_ptr);
 	assert(read_size == fsize);
 	fclose(file_ptr);
+#else
+	// map file instead of reading it, so data that is written to disk as it is never has to be copied to user space
+	m_mapping = std::make_shared<file_mapping>();
+	m_mapping->descriptor = open(filename.c_str(), O_RDONLY);
+	assert(m_mapping->descriptor >= 0);
+
+	struct stat file_stat;
+	[[maybe_unused]] int ret = fstat(m_mapping->descriptor, &file_stat);
+	assert(ret == 0);
+	assert(file_stat.st_size > 0);
+
+	m_mapping->size = file_stat.st_size;
+	m_mapping->data = static_cast<uint8_t *>(mmap(nullptr, m_mapping->size, PROT_READ, MAP_PRIVATE, m_mapping->descriptor, 0));
+	assert(m_mapping->data != MAP_FAILED);
+
+	m_data_begin = m_mapping->data;
+	m_data_ptr = m_mapping->data;
+	m_data_end = m_mapping->data + m_mapping->size;
+#endif
 }
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace parallel
+{
+	inline unsigned int & max_threads()
+	{
+		static unsigned int value = std::max(1u, std::thread::hardware_concurrency());
+		return value;
+	}
+
+	inline bool & inside_worker()
+	{
+		thread_local bool value = false;
+		return value;
+	}
+
+	// Calls callback(index) for every index in [0, count) on up to max_threads() threads.
+	// Nested calls from inside of a worker are executed serially, to avoid oversubscription.
+	// First exception thrown by callback is rethrown in calling thread once all workers are done.
+	template<typename Callback>
+	void for_each_index(size_t count, Callback && callback)
+	{
+		size_t threads_count = std::min<size_t>(count, max_threads());
+
+		if(threads_count <= 1 || inside_worker())
+		{
+			for(size_t i = 0; i < count; ++i)
+				callback(i);
+			return;
+		}
+
+		std::atomic<size_t> next_index = 0;
+		std::exception_ptr first_exception;
+		std::mutex exception_mutex;
+
+		auto worker = [&]()
+		{
+			inside_worker() = true;
+			for(size_t i = next_index++; i < count; i = next_index++)
+			{
+				try
+				{
+					callback(i);
+				}
+				catch(...)
+				{
+					std::lock_guard lock(exception_mutex);
+					if(!first_exception)
+						first_exception = std::current_exception();
+					next_index = count;
+				}
+			}
+			inside_worker() = false;
+		};
+
+		std::vector<std::thread> workers;
+		for(size_t i = 1; i < threads_count; ++i)
+			workers.emplace_back(worker);
+
+		worker();
+
+		for(auto & thread : workers)
+			thread.join();
+
+		if(first_exception)
+			std::rethrow_exception(first_exception);
+	}
+}
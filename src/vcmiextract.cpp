@@ -1,9 +1,23 @@
+#include <algorithm>
+#include <cstdlib>
+#include <sstream>
 #include <string>
+#include <vector>
 
 #include "memory_file.h"
 #include "file_format_png.h"
+#include "file_format_qoi.h"
+#include "file_format_tga.h"
+#include "kernels.h"
+#include "parallel.h"
 #include "vcmiextract.h"
 
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+#endif
+
 static bool string_iequals(const std::string& a, const std::string& b)
 {
 	return std::equal(a.begin(), a.end(), b.begin(), b.end(),
@@ -12,18 +26,160 @@ static bool string_iequals(const std::string& a, const std::string& b)
 		});
 }
 
-void vcmiextract::save_image(const basic_image_ptr & data, const std::filesystem::path & destination, const std::string & filename)
+vcmiextract::extract_options & vcmiextract::options()
 {
-	std::filesystem::create_directories(destination);
+	static extract_options instance;
+	return instance;
+}
+
+std::string vcmiextract::image_extension()
+{
+	switch(options().image_format)
+	{
+		case image_file_format::qoi:
+			return ".qoi";
+		case image_file_format::tga:
+			return ".tga";
+		default:
+			return ".png";
+	}
+}
+
+// Colors that H3 uses in first 8 entries of palette to mark transparency, shadows and selection highlight.
+// Entries that have different color are regular colors and stay opaque
+static const std::array<std::array<uint8_t, 3>, 8> special_colors = {{
+	{   0, 255, 255 },
+	{ 255, 150, 255 },
+	{ 255, 100, 255 },
+	{ 255,  50, 255 },
+	{ 255,   0, 255 },
+	{ 255, 255,   0 },
+	{ 180,   0, 255 },
+	{   0, 255,   0 },
+}};
+
+basic_image_ptr vcmiextract::expand_special_colors(const basic_image_ptr & image)
+{
+	std::array<uint8_t, 256> palette_alpha;
+	palette_alpha.fill(0xff);
+
+	for(size_t i = 0; i < special_colors.size(); ++i)
+		if(std::equal(special_colors[i].begin(), special_colors[i].end(), image->palette.get() + i * 3))
+			palette_alpha[i] = options().special_alpha[i];
+
+	return file_format_png::expand_palette(image, palette_alpha.data());
+}
+
+void vcmiextract::save_image(const basic_image_ptr & source, const std::filesystem::path & destination, const std::string & filename)
+{
+	basic_image_ptr data = source;
+	if(options().rgba && data->format == basic_image::image_format::p8)
+		data = expand_special_colors(data);
 
 	std::filesystem::path output_name = destination / filename;
+	output_name.replace_extension(image_extension());
 
-	file_format_png::optimize_and_save(data, output_name.replace_extension(".png"));
+	if(options().verify)
+	{
+		verify_image(data, output_name);
+		return;
+	}
+
+	if(options().preview)
+	{
+		preview_add(data, output_name);
+		return;
+	}
+
+	std::filesystem::create_directories(destination);
+
+	if(options().image_format == image_file_format::png && options().deferred)
+	{
+		deferred_save(data, output_name);
+		return;
+	}
+
+	// encoded image is kept in per-thread buffer, to avoid reallocations on every image
+	thread_local std::vector<uint8_t> buffer;
+	buffer.clear();
+
+	switch(options().image_format)
+	{
+		case image_file_format::qoi:
+			file_format_qoi::encode_image(data, buffer);
+			break;
+		case image_file_format::tga:
+			file_format_tga::encode_image(file_format_png::optimize_try_drop_alpha(data), buffer);
+			break;
+		default:
+			file_format_png::optimize_and_encode(data, buffer, options().png_profile);
+			break;
+	}
+
+	write_file(output_name, buffer.data(), buffer.size());
+}
+
+void vcmiextract::write_file(const std::filesystem::path & filename, const uint8_t * data, size_t size)
+{
+	if(options().verify)
+	{
+		verify_data(data, size, filename);
+		return;
+	}
+
+	FILE * fp = fopen(filename.string().c_str(), "wb");
+	assert(fp);
+
+	fwrite(data, 1, size, fp);
+	fclose(fp);
+}
+
+// Copies data that is stored in archive as it is directly from archive into output file, without passing it through user space.
+// On filesystems that support reflinks, copy_file_range may share extents instead of copying data at all
+static bool write_file_from_source(memory_file & data, const std::filesystem::path & filename)
+{
+#ifdef __linux__
+	int source = data.source_descriptor();
+	if(source < 0)
+		return false;
+
+	int target = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(target < 0)
+		return false;
+
+	off_t source_offset = data.source_offset();
+	size_t remaining = data.size();
+
+	while(remaining > 0)
+	{
+		ssize_t copied = copy_file_range(source, &source_offset, target, nullptr, remaining, 0);
+		if(copied <= 0)
+			break;
+		remaining -= copied;
+	}
+
+	// copy_file_range may be unsupported for this pair of filesystems
+	while(remaining > 0)
+	{
+		ssize_t copied = sendfile(target, source, &source_offset, remaining);
+		if(copied <= 0)
+			break;
+		remaining -= copied;
+	}
+
+	close(target);
+	return remaining == 0;
+#else
+	(void)data;
+	(void)filename;
+	return false;
+#endif
 }
 
 void vcmiextract::save_file(memory_file & data, const std::filesystem::path & destination, const std::string & filename)
 {
-	std::filesystem::create_directories(destination);
+	if(!options().verify && !options().preview)
+		std::filesystem::create_directories(destination);
 
 	std::filesystem::path filename_path(filename);
 	std::string extension = filename_path.extension().string();
@@ -34,22 +190,40 @@ void vcmiextract::save_file(memory_file & data, const std::filesystem::path & de
 	{
 		basic_image_ptr image = vcmiextract::load_image_pcx(data);
 
-		filename_path.replace_extension(".png");
+		filename_path.replace_extension(image_extension());
+		save_image(image, destination, filename_path.string());
+		return;
+	}
 
-		if(image)
+	// animations from archives are converted right away, from already unpacked data, into their own directory
+	if((!options().raw_animations || options().preview) && (string_iequals(extension, ".def") || string_iequals(extension, ".d32")))
+	{
+		// damaged animation must not stop extraction of the rest of archive, so it is saved as it is instead.
+		// Verify mode reports it as failed entry
+		try
 		{
-			save_image(image, destination, filename_path.string());
+			data.set(0);
+			extract_def(data, destination / filename_path.stem());
 			return;
 		}
+		catch(const format_error & e)
+		{
+			if(options().verify)
+				throw;
+
+			printf("animation '%s' is damaged and is not converted: %s\n", full_path.string().c_str(), e.what());
+		}
 	}
 
-	FILE * fp = fopen(full_path.string().c_str(), "wb");
-	assert(fp);
+	// in preview mode only images and animations are used
+	if(options().preview)
+		return;
 
-	data.set(0);
+	if(!options().verify && write_file_from_source(data, full_path))
+		return;
 
-	fwrite(data.ptr(), 1, data.size(), fp);
-	fclose(fp);
+	data.set(0);
+	write_file(full_path, data.ptr(), data.size());
 }
 
 void vcmiextract::extract_file(const std::filesystem::path & source, const std::filesystem::path & destination)
@@ -91,7 +265,7 @@ void vcmiextract::extract_file(const std::filesystem::path & source, const std::
 	printf("unrecognized file type '%s'\n", source.string().c_str());
 }
 
-static void process(std::string filename)
+static bool process(std::string filename)
 {
 	std::filesystem::path source_file = std::filesystem::absolute(filename);
 	std::filesystem::path target_dir = source_file;
@@ -102,22 +276,463 @@ static void process(std::string filename)
 	if(!std::filesystem::is_regular_file(source_file))
 	{
 		printf("file '%s' not found!\n", filename.c_str());
-		return;
+		return false;
+	}
+
+	// nothing is written in verify mode, only report with checksums of decoded files is printed
+	if(vcmiextract::options().verify)
+	{
+		vcmiextract::process_entry(source_file, [&](){ vcmiextract::extract_file(source_file, target_dir); });
+		return vcmiextract::verify_report(source_file.parent_path()) == 0;
 	}
 
 	if(std::filesystem::is_regular_file(target_dir))
 	{
 		printf("output path for '%s' is not a directory!\n", filename.c_str());
+		return false;
+	}
+
+	if(vcmiextract::options().deferred)
+		vcmiextract::deferred_begin(target_dir);
+
+	bool result = true;
+	try
+	{
+		vcmiextract::extract_file(source_file, target_dir);
+
+		if(vcmiextract::options().preview)
+			vcmiextract::preview_write(target_dir);
+	}
+	catch(const std::exception & e)
+	{
+		printf("failed to extract '%s': %s\n", filename.c_str(), e.what());
+		result = false;
+	}
+
+	if(vcmiextract::options().deferred)
+		vcmiextract::deferred_end();
+
+	return result;
+}
+
+static std::filesystem::path get_source_path(const std::string & filename)
+{
+	std::filesystem::path result = std::filesystem::absolute(filename).lexically_normal();
+
+	// path with trailing separator has empty filename
+	if(!result.has_filename())
+		result = result.parent_path();
+	return result;
+}
+
+// Packed and encoded files are created next to their sources, possibly over original game files, so existing ones are kept
+static bool can_write_target(const std::filesystem::path & target)
+{
+	if(vcmiextract::options().force || !std::filesystem::exists(target))
+		return true;
+
+	printf("file '%s' already exists, use --force to replace it\n", target.string().c_str());
+	return false;
+}
+
+static void pack(std::string filename)
+{
+	std::filesystem::path source_dir = get_source_path(filename);
+
+	if(!std::filesystem::is_directory(source_dir))
+	{
+		printf("directory '%s' not found!\n", filename.c_str());
+		return;
+	}
+
+	std::filesystem::path target_file = source_dir;
+	target_file += ".lod";
+
+	if(can_write_target(target_file))
+		vcmiextract::pack_lod(source_dir, target_file);
+}
+
+static void encode(std::string filename)
+{
+	std::filesystem::path source = get_source_path(filename);
+
+	if(std::filesystem::is_regular_file(source))
+	{
+		if(!string_iequals(source.extension().string(), ".png"))
+		{
+			printf("only png images can be converted to pcx, '%s' skipped\n", filename.c_str());
+			return;
+		}
+
+		std::filesystem::path target_file = std::filesystem::path(source).replace_extension(".pcx");
+		if(!can_write_target(target_file))
+			return;
+
+		std::vector<uint8_t> output;
+		if(!vcmiextract::encode_pcx(file_format_png::load_image(source), output))
+		{
+			printf("image '%s' must have a palette or be opaque\n", filename.c_str());
+			return;
+		}
+
+		vcmiextract::write_file(target_file, output.data(), output.size());
+		return;
+	}
+
+	if(!std::filesystem::is_directory(source))
+	{
+		printf("file '%s' not found!\n", filename.c_str());
+		return;
+	}
+
+	std::filesystem::path target_file = source;
+	target_file += ".def";
+
+	if(std::filesystem::is_regular_file(source / "animation.json"))
+	{
+		if(can_write_target(target_file))
+			vcmiextract::encode_def(source, target_file);
 		return;
 	}
 
-	vcmiextract::extract_file(source_file, target_dir);
+	// directory with extracted animations, for example extracted sprite archive. Every animation is encoded on its own thread
+	std::vector<std::filesystem::path> animations;
+	for(const auto & item : std::filesystem::directory_iterator(source))
+		if(item.is_directory() && std::filesystem::is_regular_file(item.path() / "animation.json"))
+			animations.push_back(item.path());
+
+	std::sort(animations.begin(), animations.end());
+
+	parallel::for_each_index(animations.size(), [&](size_t index)
+	{
+		std::filesystem::path target_file = animations[index];
+		target_file += ".def";
+		if(can_write_target(target_file))
+			vcmiextract::encode_def(animations[index], target_file);
+	});
+}
+
+static bool parse_option(const std::string & argument)
+{
+	size_t separator = argument.find('=');
+	std::string name = argument.substr(0, separator);
+	std::string value = separator == std::string::npos ? std::string() : argument.substr(separator + 1);
+
+	auto & options = vcmiextract::options();
+
+	if(name == "--format")
+	{
+		if(value == "png")
+			options.image_format = vcmiextract::image_file_format::png;
+		else if(value == "qoi")
+			options.image_format = vcmiextract::image_file_format::qoi;
+		else if(value == "tga")
+			options.image_format = vcmiextract::image_file_format::tga;
+		else
+		{
+			printf("unknown image format '%s'\n", value.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	if(name == "--png-profile")
+	{
+		if(value == "fast")
+			options.png_profile = file_format_png::encode_profile::fast;
+		else if(value == "balanced")
+			options.png_profile = file_format_png::encode_profile::balanced;
+		else if(value == "max")
+			options.png_profile = file_format_png::encode_profile::max;
+		else
+		{
+			printf("unknown png profile '%s'\n", value.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	if(name == "--sheets")
+	{
+		if(value == "sprites")
+			options.sheet_format = vcmiextract::sheet_file_format::sprites;
+		else if(value == "dds")
+			options.sheet_format = vcmiextract::sheet_file_format::dds;
+		else if(value == "ktx2")
+			options.sheet_format = vcmiextract::sheet_file_format::ktx2;
+		else
+		{
+			printf("unknown sheet format '%s'\n", value.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	if(name == "--threads")
+	{
+		int threads = std::atoi(value.c_str());
+		if(threads <= 0)
+		{
+			printf("invalid number of threads '%s'\n", value.c_str());
+			return false;
+		}
+		parallel::max_threads() = threads;
+		return true;
+	}
+
+	if(name == "--ordered")
+	{
+		options.ordered = true;
+		return true;
+	}
+
+	if(name == "--readahead")
+	{
+		options.ordered = true;
+		options.readahead = std::atoi(value.c_str());
+		return true;
+	}
+
+	if(name == "--atlas")
+	{
+		options.atlas = true;
+		return true;
+	}
+
+	if(name == "--trim")
+	{
+		options.trim = true;
+		return true;
+	}
+
+	if(name == "--rgba")
+	{
+		options.rgba = true;
+		return true;
+	}
+
+	if(name == "--special-alpha")
+	{
+		std::stringstream stream(value);
+		std::string item;
+
+		for(auto & alpha : options.special_alpha)
+		{
+			if(!std::getline(stream, item, ',') || item.empty() || std::atoi(item.c_str()) < 0 || std::atoi(item.c_str()) > 255)
+			{
+				printf("invalid list of alpha values '%s'\n", value.c_str());
+				return false;
+			}
+			alpha = static_cast<uint8_t>(std::atoi(item.c_str()));
+		}
+		options.rgba = true;
+		return true;
+	}
+
+	if(name == "--raw-animations")
+	{
+		options.raw_animations = true;
+		return true;
+	}
+
+	if(name == "--pack")
+	{
+		options.pack = true;
+		return true;
+	}
+
+	if(name == "--store-incompressible")
+	{
+		options.store_incompressible = true;
+		return true;
+	}
+
+	if(name == "--encode")
+	{
+		options.encode = true;
+		return true;
+	}
+
+	if(name == "--force")
+	{
+		options.force = true;
+		return true;
+	}
+
+	if(name == "--def-format")
+	{
+		if(value != "1" && value != "3")
+		{
+			printf("unsupported def format '%s'\n", value.c_str());
+			return false;
+		}
+		options.def_format = std::atoi(value.c_str());
+		return true;
+	}
+
+	if(name == "--verify")
+	{
+		options.verify = true;
+		return true;
+	}
+
+	if(name == "--preview")
+	{
+		if(!value.empty())
+		{
+			int size = std::atoi(value.c_str());
+			if(size <= 0)
+			{
+				printf("invalid size of preview '%s'\n", value.c_str());
+				return false;
+			}
+			options.preview_size = size;
+		}
+		options.preview = true;
+		return true;
+	}
+
+	if(name == "--overlay")
+	{
+		if(value.empty())
+		{
+			printf("output directory for overlay is not specified\n");
+			return false;
+		}
+		options.overlay = true;
+		options.overlay_destination = value;
+		return true;
+	}
+
+	if(name == "--watch")
+	{
+		options.watch = true;
+		return true;
+	}
+
+	if(name == "--kernels")
+	{
+		if(value.empty())
+			options.kernels_report = true;
+		else if(!kernels::select(value))
+		{
+			printf("kernels '%s' are not supported by this build or processor\n", value.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	if(name == "--self-check")
+	{
+		options.self_check = true;
+		return true;
+	}
+
+	if(name == "--daemon" || name == "--load-test")
+	{
+		if(name == "--daemon")
+			options.daemon = true;
+		else
+			options.load_test = true;
+		if(!value.empty())
+			options.socket_path = value;
+		return true;
+	}
+
+	if(name == "--cache-size")
+	{
+		int size = std::atoi(value.c_str());
+		if(size < 0)
+		{
+			printf("invalid cache size '%s'\n", value.c_str());
+			return false;
+		}
+		options.cache_size = size;
+		return true;
+	}
+
+	if(name == "--deferred")
+	{
+		options.deferred = true;
+		return true;
+	}
+
+	if(name == "--recompress")
+	{
+		options.recompress = true;
+		return true;
+	}
+
+	printf("unknown option '%s'\n", argument.c_str());
+	return false;
 }
 
 int main(int argc, char ** argv)
 {
+	std::vector<std::string> files;
+	int result = 0;
+
 	for(int i = 1; i < argc; ++i)
-		process(argv[i]);
+	{
+		std::string argument = argv[i];
+
+		if(argument.rfind("--", 0) == 0)
+		{
+			if(!parse_option(argument))
+				return 1;
+		}
+		else
+			files.push_back(argument);
+	}
+
+	if(vcmiextract::options().self_check)
+	{
+		kernels::report();
+		return kernels::self_check() == 0 ? 0 : 1;
+	}
+
+	if(vcmiextract::options().kernels_report)
+	{
+		kernels::report();
+		return 0;
+	}
+
+	if(!files.empty() && files.front() == "diff")
+	{
+		if(files.size() != 3)
+		{
+			printf("usage: vcmiextract [options] diff old.lod new.lod\n");
+			return 1;
+		}
+		return vcmiextract::run_diff(files[1], files[2]);
+	}
+
+	// overlay, watch, daemon and load test work with all files at once
+	if(vcmiextract::options().overlay)
+		return vcmiextract::run_overlay(files);
+
+	if(vcmiextract::options().watch)
+		return vcmiextract::run_watch(files);
+
+	if(vcmiextract::options().daemon)
+		return vcmiextract::run_daemon(files);
+
+	if(vcmiextract::options().load_test)
+		return vcmiextract::run_load_test(files);
+
+	for(const auto & file : files)
+	{
+		if(vcmiextract::options().pack)
+			pack(file);
+		else if(vcmiextract::options().encode)
+			encode(file);
+		else if(vcmiextract::options().recompress)
+			vcmiextract::deferred_resume(std::filesystem::absolute(file));
+		else if(!process(file))
+			result = 1;
+	}
+
+	vcmiextract::deferred_wait();
 
-	return 0;
+	return result;
 }
@@ -3,9 +3,80 @@
 #include "file_format_png.h"
 #include "memory_file.h"
 
+#include <array>
+#include <functional>
+
 namespace vcmiextract
 {
+	enum class image_file_format
+	{
+		png,
+		qoi,
+		tga,
+	};
+
+	enum class sheet_file_format
+	{
+		sprites, // decode sheets and save every sprite as separate image
+		dds,
+		ktx2,
+	};
+
+	struct extract_options
+	{
+		image_file_format image_format = image_file_format::png;
+		file_format_png::encode_profile png_profile = file_format_png::encode_profile::max;
+		bool deferred = false;    // write fast png first and recompress it in background
+		bool recompress = false;  // resume background recompression in directories given on command line
+		bool pack = false;        // pack directories given on command line into lod archives
+		bool store_incompressible = false; // when packing, store files that can not be compressed as they are
+		bool encode = false;      // convert extracted images and animations back into pcx and def
+		bool verify = false;      // decode every entry and report checksums of its content, without writing anything
+		bool preview = false;     // write contact sheets with small previews of images and first frames of animations
+		uint32_t preview_size = 64; // maximal width and height of preview
+		bool overlay = false;     // extract entries of all given archives into single directory, later archives override earlier ones
+		std::filesystem::path overlay_destination; // output directory of overlay mode
+		bool watch = false;       // extract given files, then extract again entries that were changed in them
+		bool daemon = false;      // serve entries of archives over UNIX domain socket
+		bool load_test = false;   // run load test against daemon
+		std::string socket_path = "vcmiextract.sock"; // socket of daemon
+		size_t cache_size = 256;  // size of cache of decoded images in daemon, in megabytes
+		bool kernels_report = false; // print instruction set of every kernel instead of extracting
+		bool self_check = false;  // compare kernels of every instruction set against scalar ones instead of extracting
+		uint32_t def_format = 1;  // compression of frames in encoded def files, 1 or 3
+		bool force = false;       // replace existing files when packing or encoding
+		bool ordered = false;     // process archive entries in order of their offsets
+		uint32_t readahead = 16;  // number of entries to prefetch in ordered mode
+		sheet_file_format sheet_format = sheet_file_format::sprites; // how sheets of HD Edition archives are saved
+		bool raw_animations = false; // save animations from archives as they are, without converting them
+		bool atlas = false;       // pack frames of animation into single image
+		bool trim = false;        // save only stored part of animation frames, without transparent margins
+		bool rgba = false;        // convert paletted images to rgba, with special colors replaced by transparency
+		std::array<uint8_t, 8> special_alpha = { 0, 64, 64, 128, 128, 0, 128, 64 }; // alpha of special colors in rgba mode
+	};
+
+	struct entry_range
+	{
+		size_t offset = 0;
+		size_t size = 0;
+	};
+
+	// entry of archive directory. Data of compressed entries is inflated into full_size bytes
+	struct archive_index_entry
+	{
+		std::string name;
+		size_t offset = 0;
+		size_t size = 0;      // size of data stored in archive
+		size_t full_size = 0;
+		bool compressed = false;
+	};
+
+	extract_options & options();
+
+	std::string image_extension();
+
 	basic_image_ptr load_image_pcx(memory_file& input);
+	basic_image_ptr expand_special_colors(const basic_image_ptr & image);
 
 	void extract_pak(memory_file& source, const std::filesystem::path& destination);
 	void extract_lod(memory_file& source, const std::filesystem::path& destination);
@@ -13,10 +84,47 @@ namespace vcmiextract
 	void extract_vid(memory_file& source, const std::filesystem::path& destination);
 	void extract_def(memory_file& source, const std::filesystem::path& destination);
 
+	std::vector<archive_index_entry> read_lod_index(memory_file& source);
+	std::vector<archive_index_entry> read_snd_index(memory_file& source);
+	std::vector<archive_index_entry> read_vid_index(memory_file& source);
+	std::vector<archive_index_entry> read_archive_index(memory_file& source, const std::filesystem::path& filename);
+	memory_file read_entry(memory_file& source, const archive_index_entry & entry);
+	void extract_entries(memory_file& source, const std::vector<archive_index_entry> & entries, const std::filesystem::path& destination);
+
 	void decompress_file(memory_file& source, memory_file& target);
+	void compress_file(const uint8_t * source, size_t size, std::vector<uint8_t> & target);
+
+	void pack_lod(const std::filesystem::path& source, const std::filesystem::path& destination);
+
+	void encode_def(const std::filesystem::path& source, const std::filesystem::path& destination);
+	bool encode_pcx(const basic_image_ptr & image, std::vector<uint8_t> & output);
+
+	void for_each_entry(memory_file& source, const std::vector<entry_range> & ranges, const std::function<void(size_t)> & callback, bool parallel = false);
 
 	void save_image(const basic_image_ptr & data, const std::filesystem::path& destination, const std::string & filename);
 	void save_file(memory_file& data, const std::filesystem::path& destination, const std::string & filename);
+	void write_file(const std::filesystem::path& filename, const uint8_t * data, size_t size);
 
 	void extract_file(const std::filesystem::path& source, const std::filesystem::path& destination);
+
+	int run_diff(const std::string & old_archive, const std::string & new_archive);
+	int run_overlay(const std::vector<std::string> & archives);
+	int run_watch(const std::vector<std::string> & files);
+	int run_daemon(const std::vector<std::string> & archives);
+	int run_load_test(const std::vector<std::string> & archives);
+
+	void process_entry(const std::filesystem::path& destination, const std::function<void()> & callback);
+	void verify_image(const basic_image_ptr & data, const std::filesystem::path& filename);
+	void verify_data(const uint8_t * data, size_t size, const std::filesystem::path& filename);
+	size_t verify_report(const std::filesystem::path& root);
+
+	bool preview_supported(const std::string & filename);
+	void preview_add(const basic_image_ptr & data, const std::filesystem::path& filename);
+	void preview_write(const std::filesystem::path& destination);
+
+	void deferred_begin(const std::filesystem::path& root);
+	void deferred_end();
+	void deferred_save(const basic_image_ptr & data, const std::filesystem::path& filename);
+	void deferred_resume(const std::filesystem::path& root);
+	void deferred_wait();
 }
@@ -1,127 +1,210 @@
 #include "vcmiextract.h"
 
+#include "parallel.h"
+
+#include <algorithm>
 #include <array>
+#include <numeric>
 #include <vector>
 
-void vcmiextract::extract_lod(memory_file & file, const std::filesystem::path & destination)
+// In ordered mode entries are visited in order of their position in source file, so reading of archive from disk is sequential.
+// Next few entries are prefetched while current ones are being decoded, and processed entries are released from memory.
+// If parallel processing is allowed, entries are processed on multiple threads, in ordered mode - in batches of readahead size
+void vcmiextract::for_each_entry(memory_file & file, const std::vector<entry_range> & ranges, const std::function<void(size_t)> & callback, bool parallel)
 {
-	struct archive_entry
+	if(!options().ordered)
 	{
-		std::array<char, 16> name{};
+		if(parallel)
+			parallel::for_each_index(ranges.size(), callback);
+		else
+			for(size_t i = 0; i < ranges.size(); ++i)
+				callback(i);
+		return;
+	}
+
+	std::vector<size_t> order(ranges.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::stable_sort(order.begin(), order.end(), [&](size_t left, size_t right){
+		return ranges[left].offset < ranges[right].offset;
+	});
+
+	size_t batch_size = parallel ? std::max<size_t>(1, options().readahead) : 1;
+	size_t prefetched = 0;
+
+	for(size_t batch_begin = 0; batch_begin < order.size(); batch_begin += batch_size)
+	{
+		size_t batch_end = std::min(order.size(), batch_begin + batch_size);
 
-		uint32_t offset = 0;
-		uint32_t full_size = 0;
-		uint32_t unused = 0;
-		uint32_t compressed_size = 0;
-	};
+		for(; prefetched < order.size() && prefetched < batch_end + options().readahead; ++prefetched)
+			file.advise_willneed(ranges[order[prefetched]].offset, ranges[order[prefetched]].size);
 
+		parallel::for_each_index(batch_end - batch_begin, [&](size_t index){
+			callback(order[batch_begin + index]);
+		});
+
+		for(size_t i = batch_begin; i < batch_end; ++i)
+			file.advise_dontneed(ranges[order[i]].offset, ranges[order[i]].size);
+	}
+}
+
+// Names in archive directories are stored in fixed-size fields and are not terminated if they fill whole field
+template<size_t size>
+static std::string get_entry_name(const std::array<char, size> & name)
+{
+	return std::string(name.data(), std::find(name.begin(), name.end(), '\0'));
+}
+
+std::vector<vcmiextract::archive_index_entry> vcmiextract::read_lod_index(memory_file & file)
+{
 	file.set(8);
 
 	uint32_t total_files = file.read<uint32_t>();
 
 	file.set(0x5c);
 
-	std::vector<archive_entry> entries;
+	std::vector<archive_index_entry> entries;
 
 	for(uint32_t i = 0; i < total_files; ++i)
 	{
-		archive_entry entry;
-
-		file.read(entry.name.data(), entry.name.size());
-		file.read(entry.offset);
-		file.read(entry.full_size);
-		file.read(entry.unused);
-		file.read(entry.compressed_size);
+		std::array<char, 16> name{};
 
+		file.read(name.data(), name.size());
+		uint32_t offset = file.read<uint32_t>();
+		uint32_t full_size = file.read<uint32_t>();
+		file.skip(4); // unused
+		uint32_t compressed_size = file.read<uint32_t>();
+
+		archive_index_entry entry;
+		entry.name = get_entry_name(name);
+		entry.offset = offset;
+		entry.size = compressed_size != 0 ? compressed_size : full_size;
+		entry.full_size = full_size;
+		entry.compressed = compressed_size != 0;
 		entries.push_back(entry);
 	}
 
-	for(const auto & entry : entries)
+	return entries;
+}
+
+std::vector<vcmiextract::archive_index_entry> vcmiextract::read_snd_index(memory_file & file)
+{
+	file.set(0);
+
+	uint32_t total_files = file.read<uint32_t>();
+
+	std::vector<archive_index_entry> entries;
+
+	for(uint32_t i = 0; i < total_files; ++i)
 	{
-		file.set(entry.offset);
+		std::array<char, 40> name{};
 
-		if(entry.compressed_size != 0)
-		{
-			memory_file compressed(file.ptr(), entry.compressed_size);
-			memory_file file_data(entry.full_size);
+		file.read(name.data(), name.size());
 
-			vcmiextract::decompress_file(compressed, file_data);
-			vcmiextract::save_file(file_data, destination, entry.name.data());
-		}
-		else
-		{
-			memory_file file_data(file.ptr(), entry.full_size);
-			vcmiextract::save_file(file_data, destination, entry.name.data());
-		}
+		archive_index_entry entry;
+		entry.name = get_entry_name(name) + ".wav";
+		entry.offset = file.read<uint32_t>();
+		entry.size = file.read<uint32_t>();
+		entry.full_size = entry.size;
+		entries.push_back(entry);
 	}
+
+	return entries;
 }
 
-void vcmiextract::extract_snd(memory_file & file, const std::filesystem::path & destination)
+// Directory of vid archive contains only offsets, every entry ends where next one begins
+std::vector<vcmiextract::archive_index_entry> vcmiextract::read_vid_index(memory_file & file)
 {
-	struct archive_entry
-	{
-		std::array<char, 40> name{};
-
-		uint32_t offset = 0;
-		uint32_t full_size = 0;
-	};
+	file.set(0);
 
 	uint32_t total_files = file.read<uint32_t>();
 
-	std::vector<archive_entry> entries;
+	std::vector<archive_index_entry> entries;
 
 	for(uint32_t i = 0; i < total_files; ++i)
 	{
-		archive_entry entry;
+		std::array<char, 40> name{};
 
-		file.read(entry.name.data(), entry.name.size());
-		file.read(entry.offset);
-		file.read(entry.full_size);
+		file.read(name.data(), name.size());
 
+		archive_index_entry entry;
+		entry.name = get_entry_name(name);
+		entry.offset = file.read<uint32_t>();
 		entries.push_back(entry);
 	}
 
-	for(const auto & entry : entries)
+	for(size_t i = 0; i < entries.size(); ++i)
 	{
-		file.set(entry.offset);
-		memory_file file_data(file.ptr(), entry.full_size);
-		vcmiextract::save_file(file_data, destination, std::string(entry.name.data()) + ".wav");
+		size_t end = i + 1 < entries.size() ? entries[i + 1].offset : file.size();
+
+		CHECK_FORMAT(entries[i].offset <= end);
+		entries[i].size = end - entries[i].offset;
+		entries[i].full_size = entries[i].size;
 	}
+
+	return entries;
 }
 
-void vcmiextract::extract_vid(memory_file & file, const std::filesystem::path & destination)
+std::vector<vcmiextract::archive_index_entry> vcmiextract::read_archive_index(memory_file & file, const std::filesystem::path & filename)
 {
-	struct archive_entry
-	{
-		std::array<char, 40> name{};
+	std::string extension = filename.extension().string();
+	std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
 
-		uint32_t begin = 0;
-		uint32_t end = 0;
-	};
+	if(extension == ".lod" || extension == ".pac")
+		return read_lod_index(file);
+	if(extension == ".snd")
+		return read_snd_index(file);
+	if(extension == ".vid")
+		return read_vid_index(file);
 
-	uint32_t total_files = file.read<uint32_t>();
+	throw std::runtime_error("unsupported archive type '" + extension + "'");
+}
 
-	std::vector<archive_entry> entries;
+// Returns content of entry. Uncompressed entries are returned as view into archive, without copying
+memory_file vcmiextract::read_entry(memory_file & file, const archive_index_entry & entry)
+{
+	if(!entry.compressed)
+		return memory_file(file, entry.offset, entry.size);
 
-	for(uint32_t i = 0; i < total_files; ++i)
+	memory_file compressed(file, entry.offset, entry.size);
+	memory_file file_data(entry.full_size);
+
+	decompress_file(compressed, file_data);
+	return file_data;
+}
+
+void vcmiextract::extract_entries(memory_file & file, const std::vector<archive_index_entry> & entries, const std::filesystem::path & destination)
+{
+	std::vector<entry_range> ranges;
+	for(const auto & entry : entries)
+		ranges.push_back({ entry.offset, entry.size });
+
+	for_each_entry(file, ranges, [&](size_t index)
 	{
-		archive_entry entry;
+		const auto & entry = entries[index];
 
-		file.read(entry.name.data(), entry.name.size());
-		file.read(entry.begin);
+		// entries that have no preview are not even unpacked
+		if(options().preview && !preview_supported(entry.name))
+			return;
 
-		if(!entries.empty())
-			entries.back().end = entry.begin;
-		entries.push_back(entry);
-	}
+		process_entry(destination / entry.name, [&]()
+		{
+			memory_file file_data = read_entry(file, entry);
+			save_file(file_data, destination, entry.name);
+		});
+	}, options().verify || options().preview);
+}
 
-	if(!entries.empty())
-		entries.back().end = file.size();
+void vcmiextract::extract_lod(memory_file & file, const std::filesystem::path & destination)
+{
+	extract_entries(file, read_lod_index(file), destination);
+}
 
-	for(const auto & entry : entries)
-	{
-		file.set(entry.begin);
-		memory_file file_data(file.ptr(), entry.end - entry.begin);
-		vcmiextract::save_file(file_data, destination, std::string(entry.name.data()));
-	}
+void vcmiextract::extract_snd(memory_file & file, const std::filesystem::path & destination)
+{
+	extract_entries(file, read_snd_index(file), destination);
+}
+
+void vcmiextract::extract_vid(memory_file & file, const std::filesystem::path & destination)
+{
+	extract_entries(file, read_vid_index(file), destination);
 }
@@ -0,0 +1,622 @@
+#include "vcmiextract.h"
+
+#include "parallel.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+// Daemon keeps archives mapped, with their directories already parsed, and serves their entries over UNIX domain socket.
+// Every request is a single line of text: "<command> <archive> [entry]", archive is file name of served archive.
+// Response is line "OK <size> [details]" followed by <size> bytes of payload, or single line "ERROR <message>".
+// Commands:
+//   list ARCHIVE        - "name size" line for every entry, size is unpacked size
+//   raw ARCHIVE ENTRY   - unpacked content of entry
+//   image ARCHIVE ENTRY - decoded pcx or p32 image as rgba pixels, row by row. Details are "<width> <height>"
+//   png ARCHIVE ENTRY   - decoded image encoded as png with fast profile
+// Names of archives and entries are case-insensitive, as in the game.
+
+namespace
+{
+	struct served_archive
+	{
+		memory_file file;
+		std::vector<vcmiextract::archive_index_entry> entries;
+		std::unordered_map<std::string, size_t> entries_by_name; // upper-case name -> index in entries
+
+		served_archive(const std::filesystem::path & path)
+			: file(path)
+			, entries(vcmiextract::read_archive_index(file, path))
+		{
+			for(size_t i = 0; i < entries.size(); ++i)
+				entries_by_name[to_upper(entries[i].name)] = i;
+		}
+
+		static std::string to_upper(std::string value)
+		{
+			std::transform(value.begin(), value.end(), value.begin(), ::toupper);
+			return value;
+		}
+	};
+
+	// Recently decoded images, bounded by total size of their pixels
+	class image_cache
+	{
+		using item = std::pair<std::string, basic_image_ptr>;
+
+		std::mutex mutex;
+		std::list<item> items; // most recently used first
+		std::unordered_map<std::string, std::list<item>::iterator> lookup;
+		size_t capacity;
+		size_t used = 0;
+
+		static size_t image_size(const basic_image_ptr & image)
+		{
+			return size_t(image->scanline) * image->height + (image->palette ? 256 * 3 : 0);
+		}
+
+	public:
+		explicit image_cache(size_t capacity)
+			: capacity(capacity)
+		{}
+
+		basic_image_ptr find(const std::string & key)
+		{
+			std::lock_guard lock(mutex);
+
+			auto it = lookup.find(key);
+			if(it == lookup.end())
+				return nullptr;
+
+			items.splice(items.begin(), items, it->second);
+			return it->second->second;
+		}
+
+		void insert(const std::string & key, const basic_image_ptr & image)
+		{
+			std::lock_guard lock(mutex);
+
+			if(lookup.count(key) || image_size(image) > capacity)
+				return;
+
+			items.emplace_front(key, image);
+			lookup[key] = items.begin();
+			used += image_size(image);
+
+			while(used > capacity)
+			{
+				used -= image_size(items.back().second);
+				lookup.erase(items.back().first);
+				items.pop_back();
+			}
+		}
+	};
+
+	struct daemon_state
+	{
+		std::unordered_map<std::string, std::unique_ptr<served_archive>> archives; // upper-case file name -> archive
+		image_cache images;
+
+		explicit daemon_state(size_t cache_size)
+			: images(cache_size)
+		{}
+	};
+}
+
+static served_archive & find_archive(daemon_state & state, const std::string & name)
+{
+	auto it = state.archives.find(served_archive::to_upper(name));
+	if(it == state.archives.end())
+		throw std::runtime_error("archive '" + name + "' is not served");
+	return *it->second;
+}
+
+static const vcmiextract::archive_index_entry & find_entry(served_archive & archive, const std::string & name)
+{
+	auto it = archive.entries_by_name.find(served_archive::to_upper(name));
+	if(it == archive.entries_by_name.end())
+		throw std::runtime_error("entry '" + name + "' not found");
+	return archive.entries[it->second];
+}
+
+static basic_image_ptr decode_image(daemon_state & state, const std::string & archive_name, const std::string & entry_name)
+{
+	served_archive & archive = find_archive(state, archive_name);
+	const auto & entry = find_entry(archive, entry_name);
+
+	std::string key = served_archive::to_upper(archive_name) + "/" + served_archive::to_upper(entry.name);
+
+	basic_image_ptr image = state.images.find(key);
+	if(image)
+		return image;
+
+	std::string extension = served_archive::to_upper(std::filesystem::path(entry.name).extension().string());
+	if(extension != ".PCX" && extension != ".P32")
+		throw std::runtime_error("entry '" + entry.name + "' is not an image");
+
+	memory_file data = vcmiextract::read_entry(archive.file, entry);
+	image = vcmiextract::load_image_pcx(data);
+
+	state.images.insert(key, image);
+	return image;
+}
+
+// Converts pixels of image, which are stored as BGR(A) or palette indices, to RGBA
+static void append_rgba(const basic_image_ptr & image, std::vector<uint8_t> & output)
+{
+	output.resize(size_t(image->width) * image->height * 4);
+	uint8_t * target = output.data();
+
+	for(uint32_t row = 0; row < image->height; ++row)
+	{
+		const uint8_t * source = image->get_pixel_ptr(0, row);
+
+		for(uint32_t col = 0; col < image->width; ++col, target += 4, source += image->bytes_per_pixel)
+		{
+			switch(image->format)
+			{
+				case basic_image::image_format::p8:
+				{
+					const uint8_t * color = image->palette.get() + 3 * source[0];
+					target[0] = color[0];
+					target[1] = color[1];
+					target[2] = color[2];
+					target[3] = image->palette_alpha ? image->palette_alpha[source[0]] : 0xff;
+					break;
+				}
+				case basic_image::image_format::g8:
+				case basic_image::image_format::ga16:
+					target[0] = target[1] = target[2] = source[0];
+					target[3] = image->format == basic_image::image_format::ga16 ? source[1] : 0xff;
+					break;
+				default:
+					target[0] = source[2];
+					target[1] = source[1];
+					target[2] = source[0];
+					target[3] = image->format == basic_image::image_format::rgba32 ? source[3] : 0xff;
+					break;
+			}
+		}
+	}
+}
+
+// Executes single request. Returns details for response header, payload is written into output
+static std::string handle_request(daemon_state & state, const std::string & request, std::vector<uint8_t> & output)
+{
+	std::istringstream stream(request);
+	std::string command, archive_name, entry_name;
+	stream >> command >> archive_name >> entry_name;
+
+	if(command == "list")
+	{
+		std::string listing;
+		for(const auto & entry : find_archive(state, archive_name).entries)
+			listing += entry.name + " " + std::to_string(entry.full_size) + "\n";
+		output.assign(listing.begin(), listing.end());
+		return {};
+	}
+
+	if(command == "raw")
+	{
+		served_archive & archive = find_archive(state, archive_name);
+		memory_file data = vcmiextract::read_entry(archive.file, find_entry(archive, entry_name));
+		output.assign(data.ptr(), data.ptr() + data.size());
+		return {};
+	}
+
+	if(command == "image")
+	{
+		basic_image_ptr image = decode_image(state, archive_name, entry_name);
+		append_rgba(image, output);
+		return std::to_string(image->width) + " " + std::to_string(image->height);
+	}
+
+	if(command == "png")
+	{
+		file_format_png::optimize_and_encode(decode_image(state, archive_name, entry_name), output, file_format_png::encode_profile::fast);
+		return {};
+	}
+
+	throw std::runtime_error("unknown command '" + command + "'");
+}
+
+#ifndef _WIN32
+static bool send_all(int connection, const void * data, size_t size)
+{
+	const uint8_t * pointer = static_cast<const uint8_t *>(data);
+
+	while(size > 0)
+	{
+		ssize_t sent = send(connection, pointer, size, MSG_NOSIGNAL);
+		if(sent <= 0)
+			return false;
+		pointer += sent;
+		size -= sent;
+	}
+	return true;
+}
+
+// Buffered reader of socket, for responses and requests that consist of text line and optional binary payload
+class socket_reader
+{
+	int connection;
+	std::vector<char> buffer;
+	size_t begin = 0;
+
+	bool fill()
+	{
+		if(begin == buffer.size())
+		{
+			buffer.clear();
+			begin = 0;
+		}
+
+		char chunk[64 * 1024];
+		ssize_t received = recv(connection, chunk, sizeof(chunk), 0);
+		if(received <= 0)
+			return false;
+		buffer.insert(buffer.end(), chunk, chunk + received);
+		return true;
+	}
+
+public:
+	explicit socket_reader(int connection)
+		: connection(connection)
+	{}
+
+	bool read_line(std::string & line)
+	{
+		for(;;)
+		{
+			auto end = std::find(buffer.begin() + begin, buffer.end(), '\n');
+			if(end != buffer.end())
+			{
+				line.assign(buffer.begin() + begin, end);
+				begin = end - buffer.begin() + 1;
+				return true;
+			}
+			if(!fill())
+				return false;
+		}
+	}
+
+	bool read(std::vector<uint8_t> & data, size_t size)
+	{
+		data.clear();
+		while(data.size() < size)
+		{
+			if(begin == buffer.size() && !fill())
+				return false;
+
+			size_t count = std::min(size - data.size(), buffer.size() - begin);
+			data.insert(data.end(), buffer.begin() + begin, buffer.begin() + begin + count);
+			begin += count;
+		}
+		return true;
+	}
+};
+
+// Connection is kept open by client for any number of requests, which are answered in order
+static void serve_connection(int connection, daemon_state & state)
+{
+	socket_reader reader(connection);
+	std::string request;
+	std::vector<uint8_t> payload;
+
+	while(reader.read_line(request))
+	{
+		std::string header;
+
+		try
+		{
+			std::string details = handle_request(state, request, payload);
+			header = "OK " + std::to_string(payload.size()) + (details.empty() ? "" : " " + details) + "\n";
+		}
+		catch(const std::exception & e)
+		{
+			header = std::string("ERROR ") + e.what() + "\n";
+			payload.clear();
+		}
+
+		if(!send_all(connection, header.data(), header.size()) || !send_all(connection, payload.data(), payload.size()))
+			break;
+	}
+
+	close(connection);
+}
+
+static bool make_socket_address(const std::string & path, sockaddr_un & address)
+{
+	address = {};
+	address.sun_family = AF_UNIX;
+
+	if(path.size() >= sizeof(address.sun_path))
+	{
+		printf("socket path '%s' is too long\n", path.c_str());
+		return false;
+	}
+
+	std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+	return true;
+}
+#endif
+
+int vcmiextract::run_daemon(const std::vector<std::string> & files)
+{
+#ifndef _WIN32
+	daemon_state state(options().cache_size * 1024 * 1024);
+
+	for(const auto & filename : files)
+	{
+		std::filesystem::path path = std::filesystem::absolute(filename);
+
+		if(!std::filesystem::is_regular_file(path))
+		{
+			printf("file '%s' not found!\n", filename.c_str());
+			continue;
+		}
+
+		try
+		{
+			auto archive = std::make_unique<served_archive>(path);
+			printf("serving '%s', %zu entries\n", path.filename().string().c_str(), archive->entries.size());
+			state.archives[served_archive::to_upper(path.filename().string())] = std::move(archive);
+		}
+		catch(const std::exception & e)
+		{
+			printf("failed to load '%s': %s\n", filename.c_str(), e.what());
+		}
+	}
+
+	sockaddr_un address;
+	if(!make_socket_address(options().socket_path, address))
+		return 1;
+
+	int server = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	// socket file left from previous run prevents bind
+	unlink(address.sun_path);
+
+	if(server < 0 || bind(server, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || listen(server, SOMAXCONN) != 0)
+	{
+		printf("failed to listen on '%s': %s\n", options().socket_path.c_str(), strerror(errno));
+		return 1;
+	}
+
+	printf("listening on '%s'\n", options().socket_path.c_str());
+	fflush(stdout);
+
+	for(;;)
+	{
+		int connection = accept(server, nullptr, nullptr);
+		if(connection < 0)
+		{
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+
+		std::thread(serve_connection, connection, std::ref(state)).detach();
+	}
+
+	close(server);
+	return 1;
+#else
+	(void)files;
+	printf("daemon mode is not supported on this platform\n");
+	return 1;
+#endif
+}
+
+#ifndef _WIN32
+namespace
+{
+	struct load_test_request
+	{
+		std::string text;
+		bool image = false;
+	};
+
+	struct load_test_result
+	{
+		std::vector<double> raw_latency; // microseconds
+		std::vector<double> image_latency;
+		size_t bytes = 0;
+		size_t errors = 0;
+	};
+}
+
+static int connect_to_daemon()
+{
+	sockaddr_un address;
+	if(!make_socket_address(vcmiextract::options().socket_path, address))
+		return -1;
+
+	int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(connection < 0 || connect(connection, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+	{
+		printf("failed to connect to '%s': %s\n", vcmiextract::options().socket_path.c_str(), strerror(errno));
+		if(connection >= 0)
+			close(connection);
+		return -1;
+	}
+	return connection;
+}
+
+// Sends request and receives its response. Returns false if connection was lost
+static bool send_request(int connection, socket_reader & reader, const std::string & request, bool & success, std::vector<uint8_t> & payload)
+{
+	std::string line = request + "\n";
+	std::string header;
+
+	if(!send_all(connection, line.data(), line.size()) || !reader.read_line(header))
+		return false;
+
+	success = header.rfind("OK ", 0) == 0;
+	payload.clear();
+
+	if(!success)
+		return true;
+
+	return reader.read(payload, std::strtoull(header.c_str() + 3, nullptr, 10));
+}
+
+static void print_latency(const char * name, std::vector<double> & latency)
+{
+	if(latency.empty())
+		return;
+
+	std::sort(latency.begin(), latency.end());
+
+	auto percentile = [&](double value){
+		return latency[std::min(latency.size() - 1, size_t(value * latency.size()))];
+	};
+
+	printf("%-6s %8zu requests, latency us: p50 %.1f, p90 %.1f, p99 %.1f, max %.1f\n", name, latency.size(), percentile(0.5), percentile(0.9), percentile(0.99), latency.back());
+}
+#endif
+
+// Load test requests every entry of given archives from every thread, first pass warms up the daemon and is not measured.
+// Pcx and p32 entries are requested as decoded images, other entries as raw data
+int vcmiextract::run_load_test(const std::vector<std::string> & archives)
+{
+#ifndef _WIN32
+	constexpr size_t measured_passes = 10;
+
+	std::vector<load_test_request> requests;
+
+	{
+		int connection = connect_to_daemon();
+		if(connection < 0)
+			return 1;
+
+		socket_reader reader(connection);
+
+		for(const auto & archive : archives)
+		{
+			bool success = false;
+			std::vector<uint8_t> listing;
+
+			if(!send_request(connection, reader, "list " + archive, success, listing) || !success)
+			{
+				printf("failed to list archive '%s'\n", archive.c_str());
+				close(connection);
+				return 1;
+			}
+
+			std::istringstream stream(std::string(listing.begin(), listing.end()));
+			std::string name;
+			size_t size;
+
+			while(stream >> name >> size)
+			{
+				std::string extension = std::filesystem::path(name).extension().string();
+				bool image = extension == ".pcx" || extension == ".PCX" || extension == ".p32" || extension == ".P32";
+				requests.push_back({ std::string(image ? "image " : "raw ") + archive + " " + name, image });
+			}
+		}
+
+		close(connection);
+	}
+
+	if(requests.empty())
+	{
+		printf("no entries to request\n");
+		return 1;
+	}
+
+	size_t threads_count = parallel::max_threads();
+	std::vector<load_test_result> results(threads_count);
+	std::vector<std::thread> threads;
+
+	auto start = std::chrono::steady_clock::now();
+
+	for(size_t thread = 0; thread < threads_count; ++thread)
+	{
+		threads.emplace_back([&, thread]()
+		{
+			auto & result = results[thread];
+
+			int connection = connect_to_daemon();
+			if(connection < 0)
+			{
+				result.errors += requests.size() * (measured_passes + 1);
+				return;
+			}
+
+			socket_reader reader(connection);
+			std::vector<uint8_t> payload;
+
+			// every thread starts from different entry, so same entries are requested concurrently only occasionally
+			for(size_t pass = 0; pass <= measured_passes; ++pass)
+			{
+				for(size_t i = 0; i < requests.size(); ++i)
+				{
+					const auto & request = requests[(i + thread * requests.size() / threads_count) % requests.size()];
+					bool success = false;
+
+					auto request_start = std::chrono::steady_clock::now();
+					if(!send_request(connection, reader, request.text, success, payload))
+					{
+						result.errors += 1;
+						close(connection);
+						return;
+					}
+					auto request_end = std::chrono::steady_clock::now();
+
+					if(!success)
+						result.errors += 1;
+
+					if(pass == 0)
+						continue;
+
+					double latency = std::chrono::duration<double, std::micro>(request_end - request_start).count();
+					(request.image ? result.image_latency : result.raw_latency).push_back(latency);
+					result.bytes += payload.size();
+				}
+			}
+
+			close(connection);
+		});
+	}
+
+	for(auto & thread : threads)
+		thread.join();
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	load_test_result total;
+	for(const auto & result : results)
+	{
+		total.raw_latency.insert(total.raw_latency.end(), result.raw_latency.begin(), result.raw_latency.end());
+		total.image_latency.insert(total.image_latency.end(), result.image_latency.begin(), result.image_latency.end());
+		total.bytes += result.bytes;
+		total.errors += result.errors;
+	}
+
+	size_t measured = total.raw_latency.size() + total.image_latency.size();
+
+	printf("%zu threads, %zu entries, %zu measured passes, %.2f s\n", threads_count, requests.size(), measured_passes, seconds);
+	print_latency("raw", total.raw_latency);
+	print_latency("image", total.image_latency);
+	printf("%.0f requests/s, %.1f MB/s, %zu errors\n", measured / seconds, total.bytes / seconds / 1024 / 1024, total.errors);
+
+	return total.errors == 0 ? 0 : 1;
+#else
+	(void)archives;
+	printf("load test is not supported on this platform\n");
+	return 1;
+#endif
+}
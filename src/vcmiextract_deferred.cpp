@@ -0,0 +1,311 @@
+#include "vcmiextract.h"
+
+#include "parallel.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#elif defined(__linux__)
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+// Two-tier png compression: images are first written with fast encoder and logged into per-directory work list,
+// background threads then replace them with max-compressed versions. Completed files are logged separately,
+// so if process is terminated before finishing, remaining files can be recompressed later with --recompress
+
+static const char * worklist_filename = ".vcmiextract-recompress";
+static const char * donelist_filename = ".vcmiextract-recompress-done";
+
+namespace
+{
+	struct deferred_worklist
+	{
+		std::filesystem::path root;
+		FILE * worklist = nullptr;
+		FILE * donelist = nullptr;
+		size_t queued = 0;
+		size_t completed = 0;
+		bool closed = false;
+	};
+
+	struct deferred_task
+	{
+		std::shared_ptr<deferred_worklist> worklist;
+		std::string relative_path;
+		uint64_t generation = 0; // generation of file at the moment it was queued
+	};
+
+	struct deferred_state
+	{
+		std::mutex mutex;
+		std::condition_variable condition;
+		std::deque<deferred_task> tasks;
+		std::vector<std::thread> workers;
+		std::shared_ptr<deferred_worklist> current;
+		std::map<std::string, uint64_t> generations; // incremented every time file is written again by fast encoder
+		bool stopping = false;
+	};
+}
+
+static deferred_state & state()
+{
+	static deferred_state instance;
+	return instance;
+}
+
+static void lower_thread_priority()
+{
+#ifdef _WIN32
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_LOWEST);
+#elif defined(__linux__)
+	// on Linux nice value is per-thread
+	setpriority(PRIO_PROCESS, 0, 19);
+#endif
+}
+
+static std::string get_file_key(const std::filesystem::path & filename)
+{
+	return filename.lexically_normal().generic_string();
+}
+
+// Every writer uses its own temporary file, so fast save and recompression of same file never write into same temporary file
+static std::filesystem::path get_temporary_name(const std::filesystem::path & filename)
+{
+	static std::atomic<uint64_t> counter = 0;
+
+	std::filesystem::path temporary = filename;
+	temporary += "." + std::to_string(counter++) + ".tmp";
+	return temporary;
+}
+
+static std::filesystem::path encode_to_temporary(const basic_image_ptr & image, const std::filesystem::path & filename, file_format_png::encode_profile profile)
+{
+	std::filesystem::path temporary = get_temporary_name(filename);
+
+	thread_local std::vector<uint8_t> buffer;
+	buffer.clear();
+
+	file_format_png::optimize_and_encode(image, buffer, profile);
+	vcmiextract::write_file(temporary, buffer.data(), buffer.size());
+	return temporary;
+}
+
+// Recompressed file replaces fast one only if file was not written again since task was queued,
+// otherwise it would replace newer content with older one
+static void recompress_file(const deferred_task & task)
+{
+	auto & deferred = state();
+	std::filesystem::path filename = task.worklist->root / task.relative_path;
+
+	auto is_current = [&]()
+	{
+		std::lock_guard lock(deferred.mutex);
+		return deferred.generations[get_file_key(filename)] == task.generation;
+	};
+
+	if(!is_current() || !std::filesystem::is_regular_file(filename))
+		return;
+
+	std::filesystem::path temporary;
+	try
+	{
+		temporary = encode_to_temporary(file_format_png::load_image(filename), filename, file_format_png::encode_profile::max);
+	}
+	catch(const std::exception & e)
+	{
+		printf("failed to recompress '%s': %s\n", filename.string().c_str(), e.what());
+		return;
+	}
+
+	std::lock_guard lock(deferred.mutex);
+	std::error_code error;
+
+	if(deferred.generations[get_file_key(filename)] == task.generation)
+		std::filesystem::rename(temporary, filename, error);
+	else
+		std::filesystem::remove(temporary, error);
+}
+
+// must be called with locked mutex
+static void try_finalize(const std::shared_ptr<deferred_worklist> & worklist)
+{
+	if(!worklist->closed || worklist->completed != worklist->queued)
+		return;
+
+	if(worklist->worklist)
+		fclose(worklist->worklist);
+	if(worklist->donelist)
+		fclose(worklist->donelist);
+	worklist->worklist = nullptr;
+	worklist->donelist = nullptr;
+
+	std::filesystem::remove(worklist->root / worklist_filename);
+	std::filesystem::remove(worklist->root / donelist_filename);
+}
+
+static void worker_thread()
+{
+	lower_thread_priority();
+
+	auto & deferred = state();
+
+	for(;;)
+	{
+		deferred_task task;
+		{
+			std::unique_lock lock(deferred.mutex);
+			deferred.condition.wait(lock, [&](){ return deferred.stopping || !deferred.tasks.empty(); });
+
+			if(deferred.tasks.empty())
+				return;
+
+			task = std::move(deferred.tasks.front());
+			deferred.tasks.pop_front();
+		}
+
+		recompress_file(task);
+
+		std::lock_guard lock(deferred.mutex);
+		fprintf(task.worklist->donelist, "%s\n", task.relative_path.c_str());
+		fflush(task.worklist->donelist);
+		task.worklist->completed += 1;
+		try_finalize(task.worklist);
+	}
+}
+
+// must be called with locked mutex
+static void enqueue(const std::shared_ptr<deferred_worklist> & worklist, const std::string & relative_path)
+{
+	auto & deferred = state();
+
+	if(deferred.workers.empty())
+	{
+		for(unsigned int i = 0; i < parallel::max_threads(); ++i)
+			deferred.workers.emplace_back(worker_thread);
+	}
+
+	worklist->queued += 1;
+	deferred.tasks.push_back({worklist, relative_path, deferred.generations[get_file_key(worklist->root / relative_path)]});
+	deferred.condition.notify_one();
+}
+
+void vcmiextract::deferred_begin(const std::filesystem::path & root)
+{
+	std::filesystem::create_directories(root);
+
+	auto worklist = std::make_shared<deferred_worklist>();
+	worklist->root = root;
+	worklist->worklist = fopen((root / worklist_filename).string().c_str(), "w");
+	worklist->donelist = fopen((root / donelist_filename).string().c_str(), "w");
+	assert(worklist->worklist);
+	assert(worklist->donelist);
+
+	std::lock_guard lock(state().mutex);
+	state().current = worklist;
+}
+
+void vcmiextract::deferred_end()
+{
+	auto & deferred = state();
+
+	std::lock_guard lock(deferred.mutex);
+	if(!deferred.current)
+		return;
+
+	deferred.current->closed = true;
+	try_finalize(deferred.current);
+	deferred.current.reset();
+}
+
+void vcmiextract::deferred_save(const basic_image_ptr & image, const std::filesystem::path & filename)
+{
+	auto & deferred = state();
+
+	// queued recompression of previous content of this file becomes stale and is skipped
+	{
+		std::lock_guard lock(deferred.mutex);
+		deferred.generations[get_file_key(filename)] += 1;
+	}
+
+	std::filesystem::path temporary = encode_to_temporary(image, filename, file_format_png::encode_profile::fast);
+
+	std::lock_guard lock(deferred.mutex);
+	std::filesystem::rename(temporary, filename);
+
+	assert(deferred.current);
+
+	std::string relative_path = filename.lexically_relative(deferred.current->root).generic_string();
+
+	fprintf(deferred.current->worklist, "%s\n", relative_path.c_str());
+	fflush(deferred.current->worklist);
+
+	enqueue(deferred.current, relative_path);
+}
+
+void vcmiextract::deferred_resume(const std::filesystem::path & root)
+{
+	if(!std::filesystem::is_regular_file(root / worklist_filename))
+	{
+		printf("nothing to recompress in '%s'\n", root.string().c_str());
+		return;
+	}
+
+	std::set<std::string> done;
+	std::vector<std::string> pending;
+
+	{
+		std::ifstream donelist(root / donelist_filename);
+		for(std::string line; std::getline(donelist, line);)
+			done.insert(line);
+
+		std::ifstream worklist(root / worklist_filename);
+		for(std::string line; std::getline(worklist, line);)
+			if(!line.empty() && done.count(line) == 0)
+				pending.push_back(line);
+	}
+
+	auto worklist = std::make_shared<deferred_worklist>();
+	worklist->root = root;
+	worklist->donelist = fopen((root / donelist_filename).string().c_str(), "a");
+	assert(worklist->donelist);
+
+	std::lock_guard lock(state().mutex);
+
+	for(const auto & relative_path : pending)
+		enqueue(worklist, relative_path);
+
+	worklist->closed = true;
+	try_finalize(worklist);
+}
+
+void vcmiextract::deferred_wait()
+{
+	auto & deferred = state();
+
+	size_t remaining;
+	{
+		std::lock_guard lock(deferred.mutex);
+		deferred.stopping = true;
+		remaining = deferred.tasks.size();
+	}
+
+	if(remaining != 0)
+		printf("recompressing %d remaining images...\n", static_cast<int>(remaining));
+
+	deferred.condition.notify_all();
+
+	for(auto & worker : deferred.workers)
+		worker.join();
+	deferred.workers.clear();
+}
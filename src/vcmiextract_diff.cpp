@@ -0,0 +1,141 @@
+#include "vcmiextract.h"
+
+#include "parallel.h"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+static std::string to_upper(std::string value)
+{
+	std::transform(value.begin(), value.end(), value.begin(), ::toupper);
+	return value;
+}
+
+static std::string get_json_list(const std::vector<vcmiextract::archive_index_entry> & entries)
+{
+	std::string result = "[";
+	for(size_t i = 0; i < entries.size(); ++i)
+		result += (i == 0 ? " \"" : ", \"") + entries[i].name + "\"";
+	return result + (entries.empty() ? "]" : " ]");
+}
+
+// Compares two versions of archive and extracts only entries that were added or modified in new one, into directory
+// next to new archive. Entries are compared by their directory metadata first, and data of entry is read only if metadata
+// is same in both versions. List of changes is written into changes.json
+int vcmiextract::run_diff(const std::string & old_filename, const std::string & new_filename)
+{
+	std::filesystem::path old_source = std::filesystem::absolute(old_filename);
+	std::filesystem::path new_source = std::filesystem::absolute(new_filename);
+
+	for(const auto & source : { old_source, new_source })
+	{
+		if(!std::filesystem::is_regular_file(source))
+		{
+			printf("file '%s' not found!\n", source.string().c_str());
+			return 1;
+		}
+	}
+
+	memory_file old_file(old_source);
+	memory_file new_file(new_source);
+
+	std::vector<archive_index_entry> old_entries;
+	std::vector<archive_index_entry> new_entries;
+
+	try
+	{
+		old_entries = read_archive_index(old_file, old_source);
+		new_entries = read_archive_index(new_file, new_source);
+	}
+	catch(const std::exception & e)
+	{
+		printf("failed to read archive directory: %s\n", e.what());
+		return 1;
+	}
+
+	std::map<std::string, const archive_index_entry *> old_by_name;
+	for(const auto & entry : old_entries)
+		old_by_name[to_upper(entry.name)] = &entry;
+
+	std::vector<archive_index_entry> added;
+	std::vector<archive_index_entry> modified;
+	std::vector<archive_index_entry> removed;
+
+	// pairs of entries with same metadata, which can be told apart only by their data
+	std::vector<std::pair<const archive_index_entry *, const archive_index_entry *>> candidates;
+	std::map<std::string, bool> new_names;
+
+	for(const auto & entry : new_entries)
+	{
+		std::string name = to_upper(entry.name);
+		new_names[name] = true;
+
+		auto previous = old_by_name.find(name);
+		if(previous == old_by_name.end())
+			added.push_back(entry);
+		else if(previous->second->size != entry.size || previous->second->full_size != entry.full_size || previous->second->compressed != entry.compressed)
+			modified.push_back(entry);
+		else
+			candidates.push_back({ previous->second, &entry });
+	}
+
+	for(const auto & entry : old_entries)
+		if(!new_names.count(to_upper(entry.name)))
+			removed.push_back(entry);
+
+	std::vector<uint8_t> differs(candidates.size());
+	try
+	{
+		parallel::for_each_index(candidates.size(), [&](size_t index)
+		{
+			memory_file old_data(old_file, candidates[index].first->offset, candidates[index].first->size);
+			memory_file new_data(new_file, candidates[index].second->offset, candidates[index].second->size);
+			differs[index] = std::memcmp(old_data.ptr(), new_data.ptr(), new_data.size()) != 0;
+		});
+	}
+	catch(const std::exception & e)
+	{
+		printf("failed to compare archives: %s\n", e.what());
+		return 1;
+	}
+
+	for(size_t i = 0; i < candidates.size(); ++i)
+		if(differs[i])
+			modified.push_back(*candidates[i].second);
+
+	// modified entries are listed and extracted in order of their position in new archive
+	std::sort(modified.begin(), modified.end(), [](const archive_index_entry & left, const archive_index_entry & right){
+		return left.offset < right.offset;
+	});
+
+	std::filesystem::path destination = new_source.parent_path() / new_source.stem();
+
+	std::vector<archive_index_entry> changed = added;
+	changed.insert(changed.end(), modified.begin(), modified.end());
+
+	std::string listing;
+	listing += "{\n";
+	listing += "\t\"added\" : " + get_json_list(added) + ",\n";
+	listing += "\t\"modified\" : " + get_json_list(modified) + ",\n";
+	listing += "\t\"removed\" : " + get_json_list(removed) + "\n";
+	listing += "}\n";
+
+	try
+	{
+		extract_entries(new_file, changed, destination);
+
+		memory_file listing_file(reinterpret_cast<uint8_t *>(listing.data()), listing.size());
+		save_file(listing_file, destination, "changes.json");
+	}
+	catch(const std::exception & e)
+	{
+		printf("failed to extract '%s': %s\n", new_filename.c_str(), e.what());
+		return 1;
+	}
+
+	printf("%zu added, %zu modified, %zu removed, %zu unchanged\n", added.size(), modified.size(), removed.size(), new_entries.size() - changed.size());
+	return 0;
+}
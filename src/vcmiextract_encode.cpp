@@ -0,0 +1,484 @@
+#include "vcmiextract.h"
+
+#include "kernels.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+// Encoders of H3 image formats - inverse of load_image_def and load_image_pcx
+
+struct listing_entry
+{
+	uint32_t group = 0;
+	uint32_t frame = 0;
+	std::string file;
+
+	uint32_t margin_left = 0;
+	uint32_t margin_top = 0;
+	uint32_t full_width = 0;
+	uint32_t full_height = 0;
+};
+
+// Reads animation.json written by extract_def. Only flat objects inside of "images" array are supported,
+// which is all that extractor writes
+static std::vector<listing_entry> load_listing(const std::string & text)
+{
+	std::vector<listing_entry> result;
+
+	size_t position = text.find("\"images\"");
+
+	while(position != std::string::npos)
+	{
+		size_t object_begin = text.find('{', position);
+		size_t object_end = text.find('}', object_begin);
+
+		if(object_begin == std::string::npos || object_end == std::string::npos)
+			break;
+
+		listing_entry entry;
+		size_t key_begin = text.find('"', object_begin);
+
+		while(key_begin < object_end)
+		{
+			size_t key_end = text.find('"', key_begin + 1);
+			std::string key = text.substr(key_begin + 1, key_end - key_begin - 1);
+
+			size_t value_begin = text.find_first_not_of(" \t:", key_end + 1);
+			std::string value;
+			size_t value_end;
+
+			if(text[value_begin] == '"')
+			{
+				value_end = text.find('"', value_begin + 1);
+				value = text.substr(value_begin + 1, value_end - value_begin - 1);
+				value_end += 1;
+			}
+			else
+			{
+				value_end = text.find_first_of(",}", value_begin);
+				value = text.substr(value_begin, value_end - value_begin);
+			}
+
+			uint32_t number = static_cast<uint32_t>(std::strtoul(value.c_str(), nullptr, 10));
+
+			if(key == "group")
+				entry.group = number;
+			if(key == "frame")
+				entry.frame = number;
+			if(key == "file")
+				entry.file = value;
+			if(key == "margin_left")
+				entry.margin_left = number;
+			if(key == "margin_top")
+				entry.margin_top = number;
+			if(key == "full_width")
+				entry.full_width = number;
+			if(key == "full_height")
+				entry.full_height = number;
+
+			key_begin = text.find('"', value_end);
+		}
+
+		result.push_back(entry);
+		position = object_end + 1;
+	}
+
+	return result;
+}
+
+struct def_segment_rules
+{
+	uint32_t max_length;      // maximal length of single segment
+	uint32_t max_run_value;   // only values up to this one can be encoded as runs
+	uint32_t header_size;     // size of segment without pixels of literal
+	uint8_t literal_type;
+};
+
+// format 1: 2 bytes per segment, any color except 0xff can be a run
+static constexpr def_segment_rules def_format_1_rules = { 256, 0xfe, 2, 0xff };
+
+// format 3: 1 byte per segment, only special colors 0-6 can be a run
+static constexpr def_segment_rules def_format_3_rules = { 32, 6, 1, 7 };
+
+static void write_segment(std::vector<uint8_t> & output, uint32_t format, uint8_t type, uint32_t length)
+{
+	if(format == 1)
+	{
+		output.push_back(type);
+		output.push_back(static_cast<uint8_t>(length - 1));
+	}
+	else
+		output.push_back(static_cast<uint8_t>(type * 32 + length - 1));
+}
+
+// Splits row into segments of smallest total size. Best encoding of every prefix of row is best encoding of shorter
+// prefix followed by one segment. Runs are only ended at end of run or at maximal length of segment, since ending
+// them earlier never saves space, so every position is extended by at most one run and by literals of any length
+static void write_segments(std::vector<uint8_t> & output, const uint8_t * row, uint32_t width, uint32_t format)
+{
+	const def_segment_rules & rules = format == 1 ? def_format_1_rules : def_format_3_rules;
+	const auto find_run_end = kernels::active().find_run_end;
+
+	struct prefix_encoding
+	{
+		uint32_t size = UINT32_MAX;
+		uint32_t last_segment = 0;  // start of last segment
+		bool last_is_run = false;
+	};
+
+	std::vector<prefix_encoding> best(width + 1);
+	best[0].size = 0;
+
+	auto extend = [&](uint32_t begin, uint32_t end, uint32_t size, bool is_run)
+	{
+		if(size < best[end].size)
+			best[end] = { size, begin, is_run };
+	};
+
+	// literal that ends at x + 1 costs size of prefix before it, minus its start, plus x + 1. Queue keeps starts within
+	// maximal length of segment with increasing value of that difference, so cheapest start is at its front
+	auto literal_weight = [&](uint32_t begin){ return int64_t(best[begin].size) - begin; };
+	std::deque<uint32_t> literal_begins;
+	uint32_t run_end = 0;
+
+	for(uint32_t x = 0; x < width; ++x)
+	{
+		if(x == run_end)
+			run_end = find_run_end(row, x, width);
+
+		if(row[x] <= rules.max_run_value)
+			extend(x, std::min(run_end, x + rules.max_length), best[x].size + rules.header_size, true);
+
+		while(!literal_begins.empty() && literal_weight(literal_begins.back()) >= literal_weight(x))
+			literal_begins.pop_back();
+		literal_begins.push_back(x);
+
+		while(literal_begins.front() + rules.max_length <= x)
+			literal_begins.pop_front();
+
+		uint32_t begin = literal_begins.front();
+		extend(begin, x + 1, best[begin].size + rules.header_size + (x + 1 - begin), false);
+	}
+
+	std::vector<uint32_t> segment_ends;
+	for(uint32_t x = width; x > 0; x = best[x].last_segment)
+		segment_ends.push_back(x);
+
+	uint32_t begin = 0;
+	for(auto it = segment_ends.rbegin(); it != segment_ends.rend(); ++it)
+	{
+		uint32_t end = *it;
+		if(best[end].last_is_run)
+			write_segment(output, format, row[begin], end - begin);
+		else
+		{
+			write_segment(output, format, rules.literal_type, end - begin);
+			output.insert(output.end(), row + begin, row + end);
+		}
+		begin = end;
+	}
+}
+
+struct def_frame_layout
+{
+	uint32_t full_width = 0;
+	uint32_t full_height = 0;
+	uint32_t margin_left = 0;  // position of image within full frame
+	uint32_t margin_top = 0;
+};
+
+// Encodes frame as frame header followed by compressed data. Only area with non-transparent pixels is stored
+static bool encode_def_frame(const basic_image & image, const def_frame_layout & layout, uint32_t format, std::vector<uint8_t> & output)
+{
+	// find area that contains non-zero pixels, in coordinates of full frame
+	const auto find_run_end = kernels::active().find_run_end;
+	uint32_t left = layout.full_width;
+	uint32_t right = 0;
+	uint32_t top = layout.full_height;
+	uint32_t bottom = 0;
+
+	for(uint32_t y = 0; y < image.height; ++y)
+	{
+		const uint8_t * row = image.pixels.get() + size_t(y) * image.scanline;
+		for(uint32_t x = 0; x < image.width;)
+		{
+			uint32_t run_end = find_run_end(row, x, image.width);
+
+			if(row[x] != 0)
+			{
+				left = std::min(left, layout.margin_left + x);
+				right = std::max(right, layout.margin_left + run_end);
+				top = std::min(top, layout.margin_top + y);
+				bottom = std::max(bottom, layout.margin_top + y + 1);
+			}
+			x = run_end;
+		}
+	}
+
+	if(left >= right)
+	{
+		left = right = 0;
+		top = bottom = 0;
+	}
+
+	uint32_t stored_width = right - left;
+	uint32_t stored_height = bottom - top;
+
+	// format 3 stores rows in blocks of 32 pixels
+	if(format == 3)
+	{
+		stored_width = (stored_width + 31) / 32 * 32;
+		if(stored_width > layout.full_width)
+			return false;
+		left = std::min(left, layout.full_width - stored_width);
+	}
+
+	std::vector<uint8_t> row(stored_width);
+	auto load_row = [&](uint32_t y)
+	{
+		std::fill(row.begin(), row.end(), 0);
+		uint32_t image_y = top + y - layout.margin_top;
+		if(top + y < layout.margin_top || image_y >= image.height)
+			return;
+
+		const uint8_t * source = image.pixels.get() + size_t(image_y) * image.scanline;
+		for(uint32_t x = 0; x < stored_width; ++x)
+		{
+			uint32_t image_x = left + x - layout.margin_left;
+			if(left + x >= layout.margin_left && image_x < image.width)
+				row[x] = source[image_x];
+		}
+	};
+
+	std::vector<uint8_t> data;
+
+	if(format == 1)
+	{
+		data.resize(stored_height * 4);
+		for(uint32_t y = 0; y < stored_height; ++y)
+		{
+			uint32_t offset = static_cast<uint32_t>(data.size());
+			std::memcpy(data.data() + y * 4, &offset, 4);
+
+			load_row(y);
+			write_segments(data, row.data(), stored_width, format);
+		}
+	}
+	else
+	{
+		uint32_t blocks = stored_width / 32;
+		data.resize(size_t(stored_height) * blocks * 2);
+		for(uint32_t y = 0; y < stored_height; ++y)
+		{
+			load_row(y);
+			for(uint32_t block = 0; block < blocks; ++block)
+			{
+				// offsets of format 3 are only 16 bits wide
+				if(data.size() > 0xffff)
+					return false;
+
+				uint16_t offset = static_cast<uint16_t>(data.size());
+				std::memcpy(data.data() + (size_t(y) * blocks + block) * 2, &offset, 2);
+
+				write_segments(data, row.data() + block * 32, 32, format);
+			}
+		}
+	}
+
+	std::array<uint32_t, 8> header = {
+		static_cast<uint32_t>(data.size()),
+		format,
+		layout.full_width,
+		layout.full_height,
+		stored_width,
+		stored_height,
+		left,
+		top,
+	};
+
+	output.resize(sizeof(header));
+	std::memcpy(output.data(), header.data(), sizeof(header));
+	output.insert(output.end(), data.begin(), data.end());
+	return true;
+}
+
+static std::string load_text_file(const std::filesystem::path & filename)
+{
+	memory_file file(filename);
+	return std::string(reinterpret_cast<const char *>(file.ptr()), file.size());
+}
+
+void vcmiextract::encode_def(const std::filesystem::path & source, const std::filesystem::path & destination)
+{
+	uint32_t format = options().def_format;
+
+	std::vector<listing_entry> listing = load_listing(load_text_file(source / "animation.json"));
+
+	// every image is encoded only once, even if it is used by multiple groups
+	std::vector<std::string> files;
+	std::map<std::string, size_t> file_index;
+	std::map<uint32_t, std::vector<size_t>> groups;
+
+	for(const auto & entry : listing)
+	{
+		if(entry.file.empty())
+		{
+			printf("%s: only animations with separate image for every frame can be encoded\n", source.string().c_str());
+			return;
+		}
+
+		auto [item, inserted] = file_index.try_emplace(entry.file, files.size());
+		if(inserted)
+			files.push_back(entry.file);
+
+		auto & group = groups[entry.group];
+		if(group.size() <= entry.frame)
+			group.resize(entry.frame + 1, item->second);
+		group[entry.frame] = item->second;
+	}
+
+	std::vector<basic_image_ptr> images(files.size());
+	std::vector<def_frame_layout> layouts(files.size());
+	std::vector<std::vector<uint8_t>> frames(files.size());
+	std::vector<uint8_t> frame_status(files.size(), 1);
+
+	for(const auto & entry : listing)
+	{
+		auto & layout = layouts[file_index[entry.file]];
+		layout.margin_left = entry.margin_left;
+		layout.margin_top = entry.margin_top;
+		layout.full_width = entry.full_width;
+		layout.full_height = entry.full_height;
+	}
+
+	parallel::for_each_index(files.size(), [&](size_t index)
+	{
+		images[index] = file_format_png::load_image(source / files[index]);
+
+		auto & layout = layouts[index];
+		if(layout.full_width == 0 && layout.full_height == 0)
+		{
+			layout.full_width = images[index]->width;
+			layout.full_height = images[index]->height;
+		}
+
+		if(images[index]->format != basic_image::image_format::p8)
+			frame_status[index] = 0;
+		else if(!encode_def_frame(*images[index], layouts[index], format, frames[index]))
+			frame_status[index] = 2;
+	});
+
+	for(size_t i = 0; i < files.size(); ++i)
+	{
+		if(frame_status[i] == 0)
+			printf("%s: image '%s' must have a palette\n", source.string().c_str(), files[i].c_str());
+		if(frame_status[i] == 2)
+			printf("%s: image '%s' can not be stored in format %d\n", source.string().c_str(), files[i].c_str(), format);
+		if(frame_status[i] != 1)
+			return;
+	}
+
+	std::vector<std::array<char, 13>> names(files.size());
+	for(size_t i = 0; i < files.size(); ++i)
+	{
+		std::string name = std::filesystem::path(files[i]).replace_extension(".pcx").string();
+		if(name.size() >= names[i].size())
+		{
+			printf("%s: name of image '%s' is too long\n", source.string().c_str(), files[i].c_str());
+			return;
+		}
+		names[i] = {};
+		std::copy(name.begin(), name.end(), names[i].begin());
+	}
+
+	// images that were saved with reduced palette still use same indices, so largest palette is palette of animation
+	const basic_image * palette_source = nullptr;
+	uint32_t width = 0;
+	uint32_t height = 0;
+
+	for(size_t i = 0; i < files.size(); ++i)
+	{
+		if(!palette_source || images[i]->palette_size > palette_source->palette_size)
+			palette_source = images[i].get();
+		width = std::max(width, layouts[i].full_width);
+		height = std::max(height, layouts[i].full_height);
+	}
+
+	std::vector<uint8_t> output;
+	auto write_u32 = [&](uint32_t value)
+	{
+		output.insert(output.end(), reinterpret_cast<const uint8_t *>(&value), reinterpret_cast<const uint8_t *>(&value) + 4);
+	};
+
+	write_u32(format == 1 ? 0x42 : 0x43); // creature or adventure map object, which are stored in these formats
+	write_u32(width);
+	write_u32(height);
+	write_u32(static_cast<uint32_t>(groups.size()));
+
+	if(palette_source)
+		output.insert(output.end(), palette_source->palette.get(), palette_source->palette.get() + 256 * 3);
+	else
+		output.resize(output.size() + 256 * 3, 0);
+
+	size_t directory_size = 0;
+	for(const auto & group : groups)
+		directory_size += 16 + group.second.size() * 17;
+
+	std::vector<uint32_t> offsets(files.size());
+	size_t offset = output.size() + directory_size;
+	for(size_t i = 0; i < files.size(); ++i)
+	{
+		offsets[i] = static_cast<uint32_t>(offset);
+		offset += frames[i].size();
+	}
+
+	for(const auto & group : groups)
+	{
+		write_u32(group.first);
+		write_u32(static_cast<uint32_t>(group.second.size()));
+		write_u32(0);
+		write_u32(0);
+
+		for(size_t image : group.second)
+			output.insert(output.end(), names[image].begin(), names[image].end());
+
+		for(size_t image : group.second)
+			write_u32(offsets[image]);
+	}
+
+	for(const auto & frame : frames)
+		output.insert(output.end(), frame.begin(), frame.end());
+
+	write_file(destination, output.data(), output.size());
+}
+
+bool vcmiextract::encode_pcx(const basic_image_ptr & source, std::vector<uint8_t> & output)
+{
+	basic_image_ptr image = file_format_png::optimize_try_drop_alpha(source);
+
+	if(image->format != basic_image::image_format::p8 && image->format != basic_image::image_format::rgb24)
+		return false;
+
+	size_t row_size = size_t(image->width) * image->bytes_per_pixel;
+	std::array<uint32_t, 3> header = { static_cast<uint32_t>(row_size * image->height), image->width, image->height };
+
+	output.resize(sizeof(header));
+	std::memcpy(output.data(), header.data(), sizeof(header));
+
+	for(uint32_t y = 0; y < image->height; ++y)
+	{
+		const uint8_t * row = image->pixels.get() + size_t(y) * image->scanline;
+		output.insert(output.end(), row, row + row_size);
+	}
+
+	if(image->format == basic_image::image_format::p8)
+		output.insert(output.end(), image->palette.get(), image->palette.get() + 256 * 3);
+
+	return true;
+}
@@ -1,6 +1,7 @@
 #include "vcmiextract.h"
 
 #include "file_format_dds.h"
+#include "file_format_ktx.h"
 
 #include <array>
 #include <vector>
@@ -94,6 +95,200 @@ struct archive_entry
 	std::vector<image_entry> images;
 };
 
+static std::string get_sheet_name(size_t index)
+{
+	if(vcmiextract::options().sheet_format == vcmiextract::sheet_file_format::ktx2)
+		return "sheet" + std::to_string(index) + ".ktx2";
+	return "sheet" + std::to_string(index) + ".dds";
+}
+
+static std::string get_sprite_properties(uint32_t sheet, uint32_t x, uint32_t y, uint32_t width, uint32_t height, uint32_t rotation)
+{
+	std::string result;
+	result += "\"sheet\" : " + std::to_string(sheet) + ", ";
+	result += "\"x\" : " + std::to_string(x) + ", ";
+	result += "\"y\" : " + std::to_string(y) + ", ";
+	result += "\"width\" : " + std::to_string(width) + ", ";
+	result += "\"height\" : " + std::to_string(height) + ", ";
+	result += "\"rotated\" : " + std::string(rotation ? "true" : "false");
+	return result;
+}
+
+// Saves sheets of archive entry without decoding them, along with description of sprites located on these sheets.
+// File must be positioned at start of compressed data of first sheet
+static void extract_sheets(memory_file & file, const archive_entry & entry, const std::filesystem::path & destination)
+{
+	for (size_t i = 0; i < entry.sheets.size(); ++i)
+	{
+		const auto & sheet = entry.sheets[i];
+
+		memory_file compressed(file, sheet.compressed_size);
+		memory_file file_data(sheet.full_size);
+		vcmiextract::decompress_file(compressed, file_data);
+		file.skip(sheet.compressed_size);
+
+		file_data.set(0);
+
+		if(vcmiextract::options().sheet_format == vcmiextract::sheet_file_format::ktx2)
+		{
+			std::vector<uint8_t> output;
+			file_format_ktx::encode_texture(file_format_dds::load_compressed(file_data), output);
+
+			if(!vcmiextract::options().verify)
+				std::filesystem::create_directories(destination);
+			vcmiextract::write_file(destination / get_sheet_name(i), output.data(), output.size());
+		}
+		else
+			vcmiextract::save_file(file_data, destination, get_sheet_name(i));
+	}
+
+	std::string listing;
+	listing += "{\n";
+	listing += "\t\"sheets\" : [ ";
+	for (size_t i = 0; i < entry.sheets.size(); ++i)
+		listing += (i == 0 ? "\"" : ", \"") + get_sheet_name(i) + "\"";
+	listing += " ],\n";
+	listing += "\t\"images\" : [\n";
+
+	for (const auto & image : entry.images)
+	{
+		listing += "\t\t{ \"name\" : \"" + image.name + "\", ";
+		listing += "\"offset_x\" : " + std::to_string(image.spriteOffsetX) + ", ";
+		listing += "\"offset_y\" : " + std::to_string(image.spriteOffsetY) + ", ";
+		listing += get_sprite_properties(image.sheetIndex, image.sheetOffsetX, image.sheetOffsetY, image.width, image.height, image.rotation);
+
+		if (image.hasShadow)
+			listing += ", \"shadow\" : { " + get_sprite_properties(image.shadowSheetIndex, image.shadowSheetOffsetX, image.shadowSheetOffsetY, image.shadowWidth, image.shadowHeight, image.shadowRotation) + " }";
+
+		listing += " },\n";
+	}
+
+	if (!entry.images.empty())
+	{
+		listing.pop_back();
+		listing.pop_back();
+		listing += "\n";
+	}
+	listing += "\t]\n}\n";
+
+	memory_file listing_file(reinterpret_cast<uint8_t *>(listing.data()), listing.size());
+	vcmiextract::save_file(listing_file, destination, "atlas.json");
+}
+
+// Decodes single entry of archive. File must contain only data of this entry, starting from its metadata
+static void extract_pak_entry(memory_file & file, archive_entry & entry, const std::filesystem::path & destination)
+{
+	std::string data;
+	data.resize(entry.metadata_size);
+
+	file.read(data.data(), data.size());
+
+	auto table = string_to_table(data);
+
+	image_entry image;
+	for(const auto & line : table)
+	{
+		CHECK_FORMAT(line.size() == 12 || line.size() == 18);
+
+		image.name = line[0];
+		image.sheetIndex = std::stol(line[1]);
+		image.spriteOffsetX = std::stol(line[2]);
+		image.unknown1 = std::stol(line[3]);
+		image.spriteOffsetY = std::stol(line[4]);
+		image.unknown2 = std::stol(line[5]);
+		image.sheetOffsetX = std::stol(line[6]);
+		image.sheetOffsetY = std::stol(line[7]);
+		image.width = std::stol(line[8]);
+		image.height = std::stol(line[9]);
+		image.rotation = std::stol(line[10]);
+		image.hasShadow = std::stol(line[11]);
+
+		CHECK_FORMAT(image.sheetIndex < entry.sheets.size());
+		CHECK_FORMAT(image.rotation == 0 || image.rotation == 1);
+
+		if(image.hasShadow)
+		{
+			CHECK_FORMAT(line.size() == 18);
+
+			image.shadowSheetIndex = std::stol(line[12]);
+			image.shadowSheetOffsetX = std::stol(line[13]);
+			image.shadowSheetOffsetY = std::stol(line[14]);
+			image.shadowWidth = std::stol(line[15]);
+			image.shadowHeight = std::stol(line[16]);
+			image.shadowRotation = std::stol(line[17]);
+
+			CHECK_FORMAT(image.shadowSheetIndex < entry.sheets.size());
+			CHECK_FORMAT(image.shadowRotation == 0 || image.shadowRotation == 1);
+
+		}
+
+		entry.images.push_back(image);
+	}
+
+	// preview of entry is its first sprite, only sheet that contains it is unpacked
+	if(vcmiextract::options().preview)
+	{
+		if(entry.images.empty())
+			return;
+
+		const auto & image = entry.images.front();
+
+		for(size_t i = 0; i < image.sheetIndex; ++i)
+			file.skip(entry.sheets[i].compressed_size);
+
+		memory_file compressed(file, entry.sheets[image.sheetIndex].compressed_size);
+		memory_file file_data(entry.sheets[image.sheetIndex].full_size);
+		vcmiextract::decompress_file(compressed, file_data);
+
+		auto sheet = file_format_dds::load(file_data);
+		CHECK_FORMAT(uint64_t(image.sheetOffsetX) + image.width <= sheet->width);
+		CHECK_FORMAT(uint64_t(image.sheetOffsetY) + image.height <= sheet->height);
+
+		auto sprite = std::make_shared<basic_image>(sheet->section(image.sheetOffsetX, image.sheetOffsetY, image.width, image.height));
+		if (image.rotation)
+			sprite = std::make_shared<basic_image>(sprite->rotateCounterclockwise());
+		vcmiextract::preview_add(sprite, destination / entry.name.data());
+		return;
+	}
+
+	if(vcmiextract::options().sheet_format != vcmiextract::sheet_file_format::sprites)
+	{
+		extract_sheets(file, entry, destination / entry.name.data());
+		return;
+	}
+
+	std::vector<basic_image_ptr> sheets;
+
+	for (const auto & sheet : entry.sheets)
+	{
+		memory_file compressed(file, sheet.compressed_size);
+		memory_file file_data(sheet.full_size);
+		vcmiextract::decompress_file(compressed, file_data);
+		sheets.push_back(file_format_dds::load(file_data));
+		file.skip(sheet.compressed_size);
+	}
+
+	for (const auto & image : entry.images)
+	{
+		CHECK_FORMAT(uint64_t(image.sheetOffsetX) + image.width <= sheets[image.sheetIndex]->width);
+		CHECK_FORMAT(uint64_t(image.sheetOffsetY) + image.height <= sheets[image.sheetIndex]->height);
+		CHECK_FORMAT(!image.hasShadow || uint64_t(image.shadowSheetOffsetX) + image.shadowWidth <= sheets[image.shadowSheetIndex]->width);
+		CHECK_FORMAT(!image.hasShadow || uint64_t(image.shadowSheetOffsetY) + image.shadowHeight <= sheets[image.shadowSheetIndex]->height);
+
+		auto sprite = std::make_shared<basic_image>(sheets.at(image.sheetIndex)->section(image.sheetOffsetX, image.sheetOffsetY, image.width, image.height));
+		if (image.rotation)
+			sprite = std::make_shared<basic_image>(sprite->rotateCounterclockwise());
+		vcmiextract::save_image(sprite, destination / entry.name.data(), image.name + ".png");
+		if (image.hasShadow)
+		{
+			auto sprite = std::make_shared<basic_image>(sheets.at(image.shadowSheetIndex)->section(image.shadowSheetOffsetX, image.shadowSheetOffsetY, image.shadowWidth, image.shadowHeight));
+			if (image.shadowRotation)
+				sprite = std::make_shared<basic_image>(sprite->rotateCounterclockwise());
+			vcmiextract::save_image(sprite, destination / entry.name.data(), image.name + "-shadow.png");
+		}
+	}
+}
+
 void vcmiextract::extract_pak(memory_file & file, const std::filesystem::path & destination)
 {
 	std::vector<archive_entry> content;
@@ -101,7 +296,7 @@ void vcmiextract::extract_pak(memory_file & file, const std::filesystem::path &
 	uint32_t magic = file.read<uint32_t>();
 	uint32_t headerOffset = file.read<uint32_t>();
 
-	assert(magic == 4);
+	CHECK_FORMAT(magic == 4);
 	file.set(headerOffset);
 
 	uint32_t entriesCount = file.read<uint32_t>();
@@ -118,6 +313,7 @@ void vcmiextract::extract_pak(memory_file & file, const std::filesystem::path &
 		file.read(entry.compressed_size);
 		file.read(entry.full_size);
 
+		CHECK_FORMAT(entry.count_sheets <= file.size() / 8);
 		entry.sheets.resize(entry.count_sheets);
 
 		for(uint32_t j = 0; j < entry.count_sheets; ++j)
@@ -129,77 +325,19 @@ void vcmiextract::extract_pak(memory_file & file, const std::filesystem::path &
 		content.push_back(entry);
 	}
 
-	for(auto & entry : content)
-	{
-		std::string data;
-		data.resize(entry.metadata_size);
-
-		file.set(entry.metadata_offset);
-		file.read(data.data(), data.size());
-
-		auto table = string_to_table(data);
-		std::vector<basic_image_ptr> sheets;
+	std::vector<entry_range> ranges;
+	for(const auto & entry : content)
+		ranges.push_back({ entry.metadata_offset, size_t(entry.metadata_size) + entry.compressed_size });
 
-		for (const auto & sheet : entry.sheets)
-		{
-			memory_file compressed(file.ptr(), sheet.compressed_size);
-			memory_file file_data(sheet.full_size);
-			vcmiextract::decompress_file(compressed, file_data);
-			sheets.push_back(file_format_dds::load(file_data));
-			file.skip(sheet.compressed_size);
-		}
-
-		image_entry image;
-		for(const auto & line : table)
-		{
-			assert(line.size() == 12 || line.size() == 18);
-
-			image.name = line[0];
-			image.sheetIndex = std::stol(line[1]);
-			image.spriteOffsetX = std::stol(line[2]);
-			image.unknown1 = std::stol(line[3]);
-			image.spriteOffsetY = std::stol(line[4]);
-			image.unknown2 = std::stol(line[5]);
-			image.sheetOffsetX = std::stol(line[6]);
-			image.sheetOffsetY = std::stol(line[7]);
-			image.width = std::stol(line[8]);
-			image.height = std::stol(line[9]);
-			image.rotation = std::stol(line[10]);
-			image.hasShadow = std::stol(line[11]);
-
-			assert(image.sheetIndex < sheets.size());
-			assert(image.rotation == 0 || image.rotation == 1);
-
-			if(image.hasShadow)
-			{
-				image.shadowSheetIndex = std::stol(line[12]);
-				image.shadowSheetOffsetX = std::stol(line[13]);
-				image.shadowSheetOffsetY = std::stol(line[14]);
-				image.shadowWidth = std::stol(line[15]);
-				image.shadowHeight = std::stol(line[16]);
-				image.shadowRotation = std::stol(line[17]);
-
-				assert(image.shadowSheetIndex < sheets.size());
-				assert(image.shadowRotation == 0 || image.shadowRotation == 1);
-
-			}
-
-			entry.images.push_back(image);
-		}
+	for_each_entry(file, ranges, [&](size_t index)
+	{
+		auto & entry = content[index];
 
-		for (const auto & image : entry.images)
+		// every entry is read through its own view, so entries can be decoded in parallel
+		process_entry(destination / entry.name.data(), [&]()
 		{
-			auto sprite = std::make_shared<basic_image>(sheets.at(image.sheetIndex)->section(image.sheetOffsetX, image.sheetOffsetY, image.width, image.height));
-			if (image.rotation)
-				sprite = std::make_shared<basic_image>(sprite->rotateCounterclockwise());
-			save_image(sprite, destination / entry.name.data(), image.name + ".png");
-			if (image.hasShadow)
-			{
-				auto sprite = std::make_shared<basic_image>(sheets.at(image.shadowSheetIndex)->section(image.shadowSheetOffsetX, image.shadowSheetOffsetY, image.shadowWidth, image.shadowHeight));
-				if (image.shadowRotation)
-					sprite = std::make_shared<basic_image>(sprite->rotateCounterclockwise());
-				save_image(sprite, destination / entry.name.data(), image.name + "-shadow.png");
-			}
-		}
-	}
+			memory_file entry_file(file, ranges[index].offset, ranges[index].size);
+			extract_pak_entry(entry_file, entry, destination);
+		});
+	}, options().verify || options().preview);
 }
@@ -1,7 +1,13 @@
 #include "vcmiextract.h"
 
+#include "kernels.h"
+
+#include <algorithm>
 #include <array>
+#include <cmath>
 #include <map>
+#include <numeric>
+#include <string>
 #include <vector>
 
 basic_image_ptr vcmiextract::load_image_pcx(memory_file & input)
@@ -21,14 +27,14 @@ basic_image_ptr vcmiextract::load_image_pcx(memory_file & input)
 		uint32_t unknown8 = input.read<uint32_t>();
 		uint32_t unknown9 = input.read<uint32_t>();
 
-		assert(magic == 0x46323350);
-		assert(size_header == 40);
-		assert(size_raw == size_header + size_data);
-		assert(size_data == width * height * bits_per_pixel / 8);
-		assert(bits_per_pixel == 32);
-		assert(unknown1 == 0);
-		assert(unknown8 == 8);
-		assert(unknown9 == 0);
+		CHECK_FORMAT(magic == 0x46323350);
+		CHECK_FORMAT(size_header == 40);
+		CHECK_FORMAT(size_raw == size_header + size_data);
+		CHECK_FORMAT(size_data == width * height * bits_per_pixel / 8);
+		CHECK_FORMAT(bits_per_pixel == 32);
+		CHECK_FORMAT(unknown1 == 0);
+		CHECK_FORMAT(unknown8 == 8);
+		CHECK_FORMAT(unknown9 == 0);
 
 		auto img = std::make_shared<basic_image>(height, width, width * 4, basic_image::image_format::rgba32);
 
@@ -62,8 +68,7 @@ basic_image_ptr vcmiextract::load_image_pcx(memory_file & input)
 		}
 	}
 
-	assert(0);
-	return basic_image_ptr();
+	throw format_error("size of pcx image does not match its dimensions");
 }
 
 struct image_entry_def
@@ -78,14 +83,43 @@ struct image_entry_def
 	uint32_t margin_top = 0;
 };
 
-static basic_image_ptr load_image_def(memory_file & file, const image_entry_def & entry, const std::array<uint8_t, 256 * 3> & palette)
+// Decoded frame of animation. If frame was decoded as trimmed, image contains only stored part of the frame,
+// and there is no image at all if frame has no stored pixels
+struct def_frame
 {
-	auto image = std::make_shared<basic_image>(entry.full_height, entry.full_width, entry.full_width, basic_image::image_format::p8);
+	basic_image_ptr image;
+	uint32_t full_width = 0;
+	uint32_t full_height = 0;
+	uint32_t margin_left = 0;
+	uint32_t margin_top = 0;
+};
+
+struct def_frame_entry
+{
+	std::array<char, 13> name{};
+	uint32_t offset = 0;
+};
+
+using def_frame_decoder = std::function<def_frame(memory_file & file, bool trimmed)>;
+
+static basic_image_ptr load_image_def(memory_file & file, const image_entry_def & entry, const std::array<uint8_t, 256 * 3> & palette, bool trimmed)
+{
+	CHECK_FORMAT(entry.full_width > 0 && entry.full_height > 0);
+	CHECK_FORMAT(uint64_t(entry.margin_left) + entry.stored_width <= entry.full_width);
+	CHECK_FORMAT(uint64_t(entry.margin_top) + entry.stored_height <= entry.full_height);
+
+	uint32_t image_width = trimmed ? entry.stored_width : entry.full_width;
+	uint32_t image_height = trimmed ? entry.stored_height : entry.full_height;
+
+	if(image_width == 0 || image_height == 0)
+		return basic_image_ptr();
+
+	auto image = std::make_shared<basic_image>(image_height, image_width, image_width, basic_image::image_format::p8);
 
 	std::copy(palette.begin(), palette.end(), image->palette.get());
 
-	uint32_t start_x = entry.margin_left;
-	uint32_t start_y = entry.margin_top;
+	uint32_t start_x = trimmed ? 0 : entry.margin_left;
+	uint32_t start_y = trimmed ? 0 : entry.margin_top;
 
 	size_t offset = file.tell();
 
@@ -101,6 +135,8 @@ static basic_image_ptr load_image_def(memory_file & file, const image_entry_def
 		}
 		case 1:
 		{
+			const auto decode_row = kernels::active().decode_def_row_1;
+
 			std::vector<uint32_t> pixel_data_offset(entry.stored_height);
 
 			file.read(pixel_data_offset.data(), pixel_data_offset.size());
@@ -109,53 +145,32 @@ static basic_image_ptr load_image_def(memory_file & file, const image_entry_def
 			{
 				file.set(offset + pixel_data_offset[y]);
 
-				for(uint32_t x = 0; x < entry.stored_width;)
-				{
-					uint8_t segment_type = file.read<uint8_t>();
-					uint32_t segment_length = file.read<uint8_t>() + 1;
-
-					if(segment_type == 0xff)
-					{
-						file.read(image->indexed(start_x + x, start_y + y).ptr, segment_length);
-					}
-					else
-					{
-						std::fill_n(image->indexed(start_x + x, start_y + y).ptr, segment_length, segment_type);
-					}
-					x += segment_length;
-				}
+				size_t row_size = decode_row(file.ptr(), file.size() - file.tell(), image->indexed(start_x, start_y + y).ptr, entry.stored_width);
+				CHECK_FORMAT(row_size != kernels::decode_error);
+				file.skip(row_size);
 			}
 			break;
 		}
 		case 2:
 		{
+			const auto decode_row = kernels::active().decode_def_row_3;
+
 			uint16_t pixel_data_offset = file.read<uint16_t>();
 
 			file.set(offset + pixel_data_offset);
 
 			for(uint32_t y = 0; y < entry.stored_height; ++y)
 			{
-				for(uint32_t x = 0; x < entry.stored_width;)
-				{
-					uint8_t segment_value = file.read<uint8_t>();
-					uint8_t segment_type = segment_value / 32;
-					uint8_t segment_length = (segment_value & 31) + 1;
-
-					if(segment_type == 7)
-					{
-						file.read(image->indexed(start_x + x, start_y + y).ptr, segment_length);
-					}
-					else
-					{
-						std::fill_n(image->indexed(start_x + x, start_y + y).ptr, segment_length, segment_type);
-					}
-					x += segment_length;
-				}
+				size_t row_size = decode_row(file.ptr(), file.size() - file.tell(), image->indexed(start_x, start_y + y).ptr, entry.stored_width);
+				CHECK_FORMAT(row_size != kernels::decode_error);
+				file.skip(row_size);
 			}
 			break;
 		}
 		case 3:
 		{
+			const auto decode_row = kernels::active().decode_def_row_3;
+
 			for(uint32_t y = 0; y < entry.stored_height; ++y)
 			{
 				file.set(offset + y * 2 * (entry.stored_width / 32));
@@ -164,32 +179,341 @@ static basic_image_ptr load_image_def(memory_file & file, const image_entry_def
 
 				file.set(offset + pixel_data_offset);
 
-				for(uint32_t x = 0; x < entry.stored_width;)
-				{
-					uint8_t segment_value = file.read<uint8_t>();
-					uint8_t segment_type = segment_value / 32;
-					uint8_t segment_length = (segment_value & 31) + 1;
-
-					if(segment_type == 7)
-					{
-						file.read(image->indexed(start_x + x, start_y + y).ptr, segment_length);
-					}
-					else
-					{
-						std::fill_n(image->indexed(start_x + x, start_y + y).ptr, segment_length, segment_type);
-					}
-					x += segment_length;
-				}
+				size_t row_size = decode_row(file.ptr(), file.size() - file.tell(), image->indexed(start_x, start_y + y).ptr, entry.stored_width);
+				CHECK_FORMAT(row_size != kernels::decode_error);
+				file.skip(row_size);
 			}
 			break;
 		}
 		default:
-			assert(0);
+			throw format_error("unknown format of def frame: " + std::to_string(entry.format));
 	}
 
 	return image;
 }
 
+static void append_listing_entry(std::string & file_listing, bool has_groups, uint32_t group, size_t frame, const std::string & properties)
+{
+	file_listing += "\t\t{ ";
+	if (has_groups)
+	{
+		file_listing += "\"group\" : ";
+		file_listing += std::to_string(group);
+		file_listing += ", ";
+	}
+
+	file_listing += "\"frame\" : ";
+	file_listing += std::to_string(frame);
+	file_listing += ", ";
+	file_listing += properties;
+	file_listing += " },\n";
+}
+
+static std::string listing_property(const char * name, uint32_t value)
+{
+	return std::string("\"") + name + "\" : " + std::to_string(value);
+}
+
+// Position of stored part of the frame within full frame, for frames that were saved trimmed
+static std::string layout_properties(const def_frame & frame)
+{
+	std::string properties;
+	properties += listing_property("margin_left", frame.margin_left) + ", ";
+	properties += listing_property("margin_top", frame.margin_top) + ", ";
+	properties += listing_property("full_width", frame.full_width) + ", ";
+	properties += listing_property("full_height", frame.full_height);
+	return properties;
+}
+
+// DEF does not store size of frames, so frame is assumed to span until next frame in file
+static std::vector<vcmiextract::entry_range> get_frame_ranges(memory_file & file, const std::vector<const def_frame_entry *> & frames)
+{
+	std::vector<size_t> offsets;
+	for(const auto & frame : frames)
+		offsets.push_back(frame->offset);
+	offsets.push_back(file.size());
+
+	std::sort(offsets.begin(), offsets.end());
+
+	std::vector<vcmiextract::entry_range> ranges;
+	for(const auto & frame : frames)
+	{
+		size_t next_offset = *std::upper_bound(offsets.begin(), offsets.end() - 1, frame->offset);
+		ranges.push_back({ frame->offset, next_offset - frame->offset });
+	}
+	return ranges;
+}
+
+// If several distinct frames have same name, only last of them ends up on disk, so there is no need to decode others.
+// This also ensures that frames that are processed in parallel never write into same file
+static std::vector<const def_frame_entry *> remove_overwritten_frames(const std::vector<const def_frame_entry *> & frames)
+{
+	std::map<std::string, size_t> last_frame_by_name;
+	for(size_t i = 0; i < frames.size(); ++i)
+		last_frame_by_name[frames[i]->name.data()] = i;
+
+	std::vector<const def_frame_entry *> result;
+	for(size_t i = 0; i < frames.size(); ++i)
+		if(last_frame_by_name[frames[i]->name.data()] == i)
+			result.push_back(frames[i]);
+
+	return result;
+}
+
+struct atlas_rect
+{
+	uint32_t x = 0;
+	uint32_t y = 0;
+	uint32_t width = 0;
+	uint32_t height = 0;
+};
+
+// Simple shelf packing: rectangles are placed in rows in order of decreasing height.
+// Width of atlas is chosen so resulting atlas is roughly square
+static void pack_atlas(std::vector<atlas_rect> & rects, uint32_t & atlas_width, uint32_t & atlas_height)
+{
+	uint64_t total_area = 0;
+	uint32_t max_width = 0;
+
+	for(const auto & rect : rects)
+	{
+		total_area += uint64_t(rect.width) * rect.height;
+		max_width = std::max(max_width, rect.width);
+	}
+
+	uint32_t shelf_width = std::max(max_width, static_cast<uint32_t>(std::ceil(std::sqrt(double(total_area)))));
+
+	std::vector<size_t> order(rects.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::stable_sort(order.begin(), order.end(), [&](size_t left, size_t right){
+		if (rects[left].height != rects[right].height)
+			return rects[left].height > rects[right].height;
+		return rects[left].width > rects[right].width;
+	});
+
+	uint32_t shelf_x = 0;
+	uint32_t shelf_y = 0;
+	uint32_t shelf_height = 0;
+
+	// empty atlas can not be saved as image
+	atlas_width = 1;
+	atlas_height = 1;
+
+	for(size_t index : order)
+	{
+		auto & rect = rects[index];
+
+		if(rect.width == 0 || rect.height == 0)
+			continue;
+
+		if(shelf_x + rect.width > shelf_width)
+		{
+			shelf_x = 0;
+			shelf_y += shelf_height;
+			shelf_height = 0;
+		}
+
+		rect.x = shelf_x;
+		rect.y = shelf_y;
+
+		shelf_x += rect.width;
+		shelf_height = std::max(shelf_height, rect.height);
+
+		atlas_width = std::max(atlas_width, rect.x + rect.width);
+		atlas_height = std::max(atlas_height, rect.y + rect.height);
+	}
+}
+
+static basic_image_ptr compose_atlas(const std::vector<def_frame> & frames, const std::vector<atlas_rect> & rects, uint32_t atlas_width, uint32_t atlas_height, const basic_image & reference)
+{
+	// all frames of animation share same format and palette
+	auto atlas = std::make_shared<basic_image>(atlas_height, atlas_width, atlas_width * reference.bytes_per_pixel, reference.format);
+
+	if(reference.palette)
+		std::copy_n(reference.palette.get(), 256 * 3, atlas->palette.get());
+
+	for(size_t i = 0; i < frames.size(); ++i)
+	{
+		if(!frames[i].image)
+			continue;
+
+		const auto & image = *frames[i].image;
+		const auto & rect = rects[i];
+
+		assert(image.format == atlas->format);
+
+		for(uint32_t y = 0; y < rect.height; ++y)
+			std::copy_n(image.pixels.get() + size_t(y) * image.scanline, size_t(rect.width) * image.bytes_per_pixel, atlas->get_pixel_ptr(rect.x, rect.y + y));
+	}
+
+	return atlas;
+}
+
+static void extract_def_frames(memory_file & file, const std::filesystem::path & destination, const std::map<uint32_t, std::vector<def_frame_entry>> & groups, const def_frame_decoder & decoder)
+{
+	struct frame_reference
+	{
+		uint32_t group = 0;
+		size_t frame = 0;
+		size_t image = 0;
+	};
+
+	// groups often reference same frames, for example idle and mouse-over groups of creatures.
+	// Every frame is decoded and saved only once, under the name of its first reference
+	std::vector<const def_frame_entry *> frames;
+	std::map<uint32_t, size_t> frames_by_offset;
+	std::vector<frame_reference> references;
+
+	for(const auto & group : groups)
+	{
+		for (size_t i = 0; i < group.second.size(); ++i)
+		{
+			const auto & entry = group.second[i];
+
+			auto [frame, inserted] = frames_by_offset.try_emplace(entry.offset, frames.size());
+			if(inserted)
+				frames.push_back(&entry);
+
+			references.push_back({ group.first, i, frame->second });
+		}
+	}
+
+	bool has_groups = groups.size() > 1;
+
+	file.set(0);
+	uint8_t * file_data = file.ptr();
+	size_t file_size = file.size();
+
+	// frames are independent from each other, so every one of them is decoded by separate task with its own read cursor
+	auto decode_frame = [&](const def_frame_entry & entry, bool trimmed)
+	{
+		try
+		{
+			memory_file frame_file(file_data, file_size);
+			frame_file.set(entry.offset);
+			return decoder(frame_file, trimmed);
+		}
+		catch(const format_error & e)
+		{
+			throw format_error("frame '" + std::string(entry.name.data()) + "': " + e.what());
+		}
+	};
+
+	// preview of animation is its first frame, other frames are not decoded at all
+	if(vcmiextract::options().preview)
+	{
+		if(frames.empty())
+			return;
+
+		def_frame frame = decode_frame(*frames.front(), true);
+		if(!frame.image)
+			frame = decode_frame(*frames.front(), false);
+
+		vcmiextract::preview_add(frame.image, destination);
+		return;
+	}
+
+	std::string file_listing;
+	file_listing += "{\n";
+
+	if(vcmiextract::options().atlas)
+	{
+		std::vector<def_frame> decoded(frames.size());
+		std::vector<atlas_rect> rects(frames.size());
+
+		// frames without stored pixels take no space in atlas, and are listed with zero size
+		vcmiextract::for_each_entry(file, get_frame_ranges(file, frames), [&](size_t index)
+		{
+			decoded[index] = decode_frame(*frames[index], true);
+			if(!decoded[index].image)
+				return;
+
+			rects[index].width = decoded[index].image->width;
+			rects[index].height = decoded[index].image->height;
+		}, true);
+
+		uint32_t atlas_width = 0;
+		uint32_t atlas_height = 0;
+
+		pack_atlas(rects, atlas_width, atlas_height);
+
+		auto reference = std::find_if(decoded.begin(), decoded.end(), [](const def_frame & frame){ return frame.image != nullptr; });
+		if(reference != decoded.end())
+		{
+			vcmiextract::save_image(compose_atlas(decoded, rects, atlas_width, atlas_height, *reference->image), destination, "atlas");
+			file_listing += "\t\"atlas\" : \"atlas" + vcmiextract::image_extension() + "\",\n";
+		}
+
+		file_listing += "\t\"images\" : [\n";
+
+		for(const auto & reference : references)
+		{
+			const auto & rect = rects[reference.image];
+			const auto & frame = decoded[reference.image];
+
+			std::string properties;
+			properties += listing_property("x", rect.x) + ", ";
+			properties += listing_property("y", rect.y) + ", ";
+			properties += listing_property("width", rect.width) + ", ";
+			properties += listing_property("height", rect.height) + ", ";
+			properties += layout_properties(frame);
+
+			append_listing_entry(file_listing, has_groups, reference.group, reference.frame, properties);
+		}
+	}
+	else
+	{
+		bool trimmed = vcmiextract::options().trim;
+
+		std::vector<const def_frame_entry *> saved_frames = remove_overwritten_frames(frames);
+		std::vector<def_frame> saved_layout(saved_frames.size());
+
+		vcmiextract::for_each_entry(file, get_frame_ranges(file, saved_frames), [&](size_t index)
+		{
+			const auto & entry = *saved_frames[index];
+			def_frame frame = decode_frame(entry, trimmed);
+
+			// frame without any stored pixels can not be saved as empty image, so it is saved in full instead
+			if(!frame.image)
+			{
+				frame = decode_frame(entry, false);
+				frame.margin_left = 0;
+				frame.margin_top = 0;
+			}
+
+			vcmiextract::save_image(frame.image, destination, entry.name.data());
+
+			frame.image.reset();
+			saved_layout[index] = frame;
+		}, true);
+
+		std::map<std::string, size_t> saved_frames_by_name;
+		for(size_t i = 0; i < saved_frames.size(); ++i)
+			saved_frames_by_name[saved_frames[i]->name.data()] = i;
+
+		file_listing += "\t\"images\" : [\n";
+
+		for(const auto & reference : references)
+		{
+			std::string name = std::filesystem::path(frames[reference.image]->name.data()).replace_extension(vcmiextract::image_extension()).string();
+			std::string properties = "\"file\" : \"" + name + "\"";
+
+			if(trimmed)
+				properties += ", " + layout_properties(saved_layout[saved_frames_by_name.at(frames[reference.image]->name.data())]);
+
+			append_listing_entry(file_listing, has_groups, reference.group, reference.frame, properties);
+		}
+	}
+
+	file_listing.pop_back();
+	file_listing.pop_back();
+	file_listing += "\n\t]\n}\n";
+
+	memory_file listing_file(reinterpret_cast<uint8_t *>(file_listing.data()), file_listing.size());
+
+	vcmiextract::save_file(listing_file, destination, "animation.json");
+}
+
 static void extract_def_h3(memory_file & file, const std::filesystem::path & destination)
 {
 	[[maybe_unused]] uint32_t type = file.read<uint32_t>();
@@ -202,15 +526,9 @@ static void extract_def_h3(memory_file & file, const std::filesystem::path & des
 	for(auto & entry : palette)
 		file.read(entry);
 
-	struct archive_entry
-	{
-		std::array<char, 13> name{};
-		uint32_t offset = 0;
-	};
-
 	struct archive_block_entry
 	{
-		std::vector<archive_entry> entries;
+		std::vector<def_frame_entry> entries;
 
 		uint32_t index = 0;
 		uint32_t size = 0;
@@ -218,7 +536,7 @@ static void extract_def_h3(memory_file & file, const std::filesystem::path & des
 		uint32_t unknown2 = 0;
 	};
 
-	std::map<uint32_t, archive_block_entry> groups;
+	std::map<uint32_t, std::vector<def_frame_entry>> groups;
 
 	for(uint32_t i = 0; i < total_groups; ++i)
 	{
@@ -229,6 +547,8 @@ static void extract_def_h3(memory_file & file, const std::filesystem::path & des
 		file.read(group.unknown1);
 		file.read(group.unknown2);
 
+		// every frame takes 17 bytes of header, so corrupted count is detected before allocation
+		CHECK_FORMAT(group.size <= file.size() / 17);
 		group.entries.resize(group.size);
 
 		for(uint32_t j = 0; j < group.size; ++j)
@@ -237,73 +557,43 @@ static void extract_def_h3(memory_file & file, const std::filesystem::path & des
 		for(uint32_t j = 0; j < group.size; ++j)
 			file.read(group.entries[j].offset);
 
-		assert(groups.count(group.index) == 0);
-		groups[group.index] = group;
+		CHECK_FORMAT(groups.count(group.index) == 0);
+		groups[group.index] = group.entries;
 	}
 
-	std::string file_listing;
-	file_listing += "{\n";
-	file_listing += "\t\"images\" : [\n";
-
-	for(const auto & group : groups)
+	extract_def_frames(file, destination, groups, [&](memory_file & frame_file, bool trimmed)
 	{
-		for (size_t i = 0; i < group.second.entries.size(); ++i)
-		{
-			const auto & entry = group.second.entries[i];
+		image_entry_def header;
 
-			image_entry_def header;
+		frame_file.read(header.size);
+		frame_file.read(header.format);
+		frame_file.read(header.full_width);
+		frame_file.read(header.full_height);
 
-			file.set(entry.offset);
-
-			file.read(header.size);
-			file.read(header.format);
-			file.read(header.full_width);
-			file.read(header.full_height);
-
-			file.read(header.stored_width);
-			file.read(header.stored_height);
-			file.read(header.margin_left);
-			file.read(header.margin_top);
-
-			// special case for some "old" format defs (SGTWMTA.DEF and SGTWMTB.DEF)
-			if(header.format == 1 && header.stored_width > header.full_width && header.stored_height > header.full_height)
-			{
-				header.stored_height = header.full_height;
-				header.stored_width = header.full_width;
-				header.margin_left = 0;
-				header.margin_top = 0;
-
-				file.set(file.tell() - 16);
-			}
+		frame_file.read(header.stored_width);
+		frame_file.read(header.stored_height);
+		frame_file.read(header.margin_left);
+		frame_file.read(header.margin_top);
 
-			basic_image_ptr image = load_image_def(file, header, palette);
-
-			file_listing += "\t\t{ ";
-			if (groups.size() > 1)
-			{
-				file_listing += "\"group\" : ";
-				file_listing += std::to_string(group.second.index);
-				file_listing += ", ";
-			}
-
-			file_listing += "\"frame\" : ";
-			file_listing += std::to_string(i);
-
-			file_listing += ", \"file\" : \"";
-			file_listing += std::filesystem::path(entry.name.data()).replace_extension(".png").string();
-			file_listing += "\" },\n";
+		// special case for some "old" format defs (SGTWMTA.DEF and SGTWMTB.DEF)
+		if(header.format == 1 && header.stored_width > header.full_width && header.stored_height > header.full_height)
+		{
+			header.stored_width = header.full_width;
+			header.stored_height = header.full_height;
+			header.margin_left = 0;
+			header.margin_top = 0;
 
-			vcmiextract::save_image(image, destination, entry.name.data());
+			frame_file.set(frame_file.tell() - 16);
 		}
-	}
-
-	file_listing.pop_back();
-	file_listing.pop_back();
-	file_listing += "\n\t]\n}\n";
-
-	memory_file listing_file(reinterpret_cast<uint8_t *>(file_listing.data()), file_listing.size());
 
-	vcmiextract::save_file(listing_file, destination, "animation.json");
+		def_frame frame;
+		frame.image = load_image_def(frame_file, header, palette, trimmed);
+		frame.full_width = header.full_width;
+		frame.full_height = header.full_height;
+		frame.margin_left = header.margin_left;
+		frame.margin_top = header.margin_top;
+		return frame;
+	});
 }
 
 static void extract_def_d32f(memory_file & file, const std::filesystem::path & destination)
@@ -317,21 +607,15 @@ static void extract_def_d32f(memory_file & file, const std::filesystem::path & d
 	uint32_t unknown6 = file.read<uint32_t>();
 	uint32_t unknown7 = file.read<uint32_t>();
 
-	assert(magic == 0x46323344);
-	assert(unknown1 == 1);
-	assert(unknown2 == 24);
-	assert(unknown6 == 8);
-	assert(unknown7 == 1 || unknown7 == 22); // groups?
-
-	struct archive_entry
-	{
-		std::array<char, 13> name{};
-		uint32_t offset = 0;
-	};
+	CHECK_FORMAT(magic == 0x46323344);
+	CHECK_FORMAT(unknown1 == 1);
+	CHECK_FORMAT(unknown2 == 24);
+	CHECK_FORMAT(unknown6 == 8);
+	CHECK_FORMAT(unknown7 == 1 || unknown7 == 22); // groups?
 
 	struct archive_block_entry
 	{
-		std::vector<archive_entry> entries;
+		std::vector<def_frame_entry> entries;
 
 		uint32_t header_size = 0;
 		uint32_t index = 0;
@@ -339,7 +623,8 @@ static void extract_def_d32f(memory_file & file, const std::filesystem::path & d
 		uint32_t unknown2 = 0;
 	};
 
-	std::map<uint32_t, archive_block_entry> groups;
+	std::map<uint32_t, std::vector<def_frame_entry>> groups;
+	uint32_t last_frame_offset = 0;
 
 	for(uint32_t i = 0; i < total_groups; ++i)
 	{
@@ -349,84 +634,74 @@ static void extract_def_d32f(memory_file & file, const std::filesystem::path & d
 		file.read(group.index);
 		file.read(group.size);
 		file.read(group.unknown2);
-		assert(group.header_size == 17 * group.size + 16);
+		CHECK_FORMAT(group.header_size == 17 * group.size + 16);
 
+		// every frame takes 17 bytes of header, so corrupted count is detected before allocation
+		CHECK_FORMAT(group.size <= file.size() / 17);
 		group.entries.resize(group.size);
 
 		for(uint32_t j = 0; j < group.size; ++j)
 			file.read(group.entries[j].name.data(), group.entries[j].name.size());
 
 		for(uint32_t j = 0; j < group.size; ++j)
+		{
 			file.read(group.entries[j].offset);
+			last_frame_offset = std::max(last_frame_offset, group.entries[j].offset);
+		}
 
-		assert(groups.count(group.index) == 0);
-		groups[group.index] = group;
+		CHECK_FORMAT(groups.count(group.index) == 0);
+		groups[group.index] = group.entries;
 	}
 
-	std::string file_listing;
-	file_listing += "{\n";
-	file_listing += "\t\"images\" : [\n";
-
-	for(const auto & group : groups)
+	extract_def_frames(file, destination, groups, [&](memory_file & frame_file, bool trimmed)
 	{
-		for (size_t i = 0; i < group.second.entries.size(); ++i)
+		size_t frame_offset = frame_file.tell();
+
+		uint32_t bits_per_pixel = frame_file.read<uint32_t>();
+		uint32_t image_size = frame_file.read<uint32_t>();
+		uint32_t full_width = frame_file.read<uint32_t>();
+		uint32_t full_height = frame_file.read<uint32_t>();
+		uint32_t stored_width = frame_file.read<uint32_t>();
+		uint32_t stored_height = frame_file.read<uint32_t>();
+		uint32_t margin_left = frame_file.read<uint32_t>();
+		uint32_t margin_top = frame_file.read<uint32_t>();
+		uint32_t entry_unknown1 = frame_file.read<uint32_t>();
+		uint32_t entry_unknown2 = frame_file.read<uint32_t>();
+
+		CHECK_FORMAT(full_width > 0 && full_height > 0);
+		CHECK_FORMAT(uint64_t(margin_left) + stored_width <= full_width);
+		CHECK_FORMAT(uint64_t(margin_top) + stored_height <= full_height);
+		CHECK_FORMAT(entry_unknown1 == 8);
+		CHECK_FORMAT(entry_unknown2 == 0 || entry_unknown2 == 1);
+		CHECK_FORMAT(bits_per_pixel == 32);
+		CHECK_FORMAT(image_size == stored_width * stored_height * 4);
+
+		uint32_t image_width = trimmed ? stored_width : full_width;
+		uint32_t image_height = trimmed ? stored_height : full_height;
+		uint32_t start_x = trimmed ? 0 : margin_left;
+		uint32_t start_y = trimmed ? 0 : margin_top;
+
+		def_frame frame;
+
+		if(image_width > 0 && image_height > 0)
 		{
-			const auto & entry = group.second.entries[i];
-			file.set(entry.offset);
-
-			uint32_t bits_per_pixel = file.read<uint32_t>();
-			uint32_t image_size = file.read<uint32_t>();
-			uint32_t full_width = file.read<uint32_t>();
-			uint32_t full_height = file.read<uint32_t>();
-			uint32_t stored_width = file.read<uint32_t>();
-			uint32_t stored_height = file.read<uint32_t>();
-			uint32_t margin_left = file.read<uint32_t>();
-			uint32_t margin_top = file.read<uint32_t>();
-			uint32_t entry_unknown1 = file.read<uint32_t>();
-			uint32_t entry_unknown2 = file.read<uint32_t>();
-
-			assert(stored_width <= full_width);
-			assert(stored_height <= full_height);
-			assert(entry_unknown1 == 8);
-			assert(entry_unknown2 == 0 || entry_unknown2 == 1);
-			assert(bits_per_pixel == 32);
-			assert(image_size == stored_width * stored_height * 4);
-
-			auto image = std::make_shared<basic_image>(full_height, full_width, full_width * 4, basic_image::image_format::rgba32);
+			frame.image = std::make_shared<basic_image>(image_height, image_width, image_width * 4, basic_image::image_format::rgba32);
 
 			for(uint32_t y = 0; y < stored_height; ++y)
 			{
-				file.read(image->rgba(margin_left, margin_top + stored_height - y - 1).ptr, stored_width * 4);
+				frame_file.read(frame.image->rgba(start_x, start_y + stored_height - y - 1).ptr, stored_width * 4);
 			}
-
-			file_listing += "\t\t{ ";
-			if (groups.size() > 1)
-			{
-				file_listing += "\"group\" : ";
-				file_listing += std::to_string(group.second.index);
-				file_listing += ", ";
-			}
-
-			file_listing += "\"frame\" : ";
-			file_listing += std::to_string(i);
-
-			file_listing += ", \"file\" : \"";
-			file_listing += std::filesystem::path(entry.name.data()).replace_extension(".png").string();
-			file_listing += "\" },\n";
-
-			vcmiextract::save_image(image, destination, entry.name.data());
 		}
-	}
-
-	assert(file.eof());
 
-	file_listing.pop_back();
-	file_listing.pop_back();
-	file_listing += "\n\t]\n}\n";
+		// last frame must end exactly at the end of file
+		CHECK_FORMAT(frame_offset != last_frame_offset || frame_file.eof());
 
-	memory_file listing_file(reinterpret_cast<uint8_t *>(file_listing.data()), file_listing.size());
-
-	vcmiextract::save_file(listing_file, destination, "animation.json");
+		frame.full_width = full_width;
+		frame.full_height = full_height;
+		frame.margin_left = margin_left;
+		frame.margin_top = margin_top;
+		return frame;
+	});
 }
 
 void vcmiextract::extract_def(memory_file & file, const std::filesystem::path & destination)
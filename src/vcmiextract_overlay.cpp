@@ -0,0 +1,103 @@
+#include "vcmiextract.h"
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace
+{
+	struct overlay_entry
+	{
+		size_t archive = 0;
+		vcmiextract::archive_index_entry entry;
+	};
+}
+
+// Resource as it is identified by VCMI: upper-case name without extension, and kind of resource. Extensions of same kind
+// replace each other, for example FOO.PCX from mod replaces FOO.P32 from base game, just as both are extracted into FOO.png
+static std::string get_resource_key(const std::string & name)
+{
+	std::filesystem::path path(name);
+
+	std::string extension = path.extension().string();
+	std::transform(extension.begin(), extension.end(), extension.begin(), ::toupper);
+
+	if(extension == ".PCX" || extension == ".P32")
+		extension = "image";
+	if(extension == ".DEF" || extension == ".D32")
+		extension = "animation";
+
+	std::string stem = path.stem().string();
+	std::transform(stem.begin(), stem.end(), stem.begin(), ::toupper);
+
+	return stem + ":" + extension;
+}
+
+// Archives are given in order of their priority, from base game to last mod. Entry from later archive overrides entries
+// with same name from all previous ones, and within single archive later entry overrides earlier one, as in VCMI.
+// Only winning entries are read from archives, all others are skipped without being inflated
+int vcmiextract::run_overlay(const std::vector<std::string> & files)
+{
+	std::vector<std::unique_ptr<memory_file>> archives;
+	std::map<std::string, overlay_entry> index;
+	size_t total_entries = 0;
+
+	for(const auto & filename : files)
+	{
+		std::filesystem::path source = std::filesystem::absolute(filename);
+
+		if(!std::filesystem::is_regular_file(source))
+		{
+			printf("file '%s' not found!\n", filename.c_str());
+			return 1;
+		}
+
+		try
+		{
+			auto archive = std::make_unique<memory_file>(source);
+
+			for(const auto & entry : read_archive_index(*archive, source))
+			{
+				index[get_resource_key(entry.name)] = { archives.size(), entry };
+				total_entries += 1;
+			}
+
+			archives.push_back(std::move(archive));
+		}
+		catch(const std::exception & e)
+		{
+			printf("failed to read directory of '%s': %s\n", filename.c_str(), e.what());
+			return 1;
+		}
+	}
+
+	std::vector<std::vector<archive_index_entry>> winners(archives.size());
+	for(const auto & item : index)
+		winners[item.second.archive].push_back(item.second.entry);
+
+	std::filesystem::path destination = std::filesystem::absolute(options().overlay_destination);
+
+	if(options().deferred)
+		deferred_begin(destination);
+
+	for(size_t i = 0; i < archives.size(); ++i)
+	{
+		// entries are read in order of their position in archive, so reading from disk is sequential
+		std::sort(winners[i].begin(), winners[i].end(), [](const archive_index_entry & left, const archive_index_entry & right){
+			return left.offset < right.offset;
+		});
+
+		extract_entries(*archives[i], winners[i], destination);
+	}
+
+	if(options().deferred)
+		deferred_end();
+
+	printf("%zu entries in %zu archives, %zu extracted, %zu overridden\n", total_entries, archives.size(), index.size(), total_entries - index.size());
+
+	if(options().verify)
+		return verify_report(destination.parent_path()) == 0 ? 0 : 1;
+	return 0;
+}
@@ -0,0 +1,129 @@
+#include "vcmiextract.h"
+
+#include "parallel.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <vector>
+
+// Writes lod archive in the same layout that is read by extract_lod:
+// header with number of files at offset 8, directory of 32-byte entries at 0x5c, followed by data of all files.
+// Files are compressed on multiple threads in batches and written to archive in order, so only one batch is kept in memory
+void vcmiextract::pack_lod(const std::filesystem::path & source, const std::filesystem::path & destination)
+{
+	struct archive_entry
+	{
+		std::filesystem::path path;
+		std::array<char, 16> name{};
+
+		uint32_t offset = 0;
+		uint32_t full_size = 0;
+		uint32_t compressed_size = 0;
+	};
+
+	std::vector<archive_entry> entries;
+
+	for(const auto & item : std::filesystem::directory_iterator(source))
+	{
+		std::string name = item.path().filename().string();
+
+		if(!item.is_regular_file())
+		{
+			printf("skipping '%s': only files can be packed\n", name.c_str());
+			continue;
+		}
+
+		if(name.size() >= std::tuple_size_v<decltype(archive_entry::name)>)
+		{
+			printf("skipping '%s': name is too long for lod archive\n", name.c_str());
+			continue;
+		}
+
+		archive_entry entry;
+		entry.path = item.path();
+		std::copy(name.begin(), name.end(), entry.name.begin());
+		entries.push_back(entry);
+	}
+
+	std::sort(entries.begin(), entries.end(), [](const archive_entry & left, const archive_entry & right){
+		return left.path < right.path;
+	});
+
+	FILE * fp = fopen(destination.string().c_str(), "wb");
+	assert(fp);
+
+	// header and directory are written at the end, once sizes of all files are known
+	std::vector<uint8_t> header(0x5c + entries.size() * 32, 0);
+	fwrite(header.data(), 1, header.size(), fp);
+
+	size_t offset = header.size();
+	size_t batch_size = size_t(parallel::max_threads()) * 4;
+	std::vector<std::vector<uint8_t>> batch_data(batch_size);
+
+	for(size_t batch_begin = 0; batch_begin < entries.size(); batch_begin += batch_size)
+	{
+		size_t batch_end = std::min(entries.size(), batch_begin + batch_size);
+
+		parallel::for_each_index(batch_end - batch_begin, [&](size_t index)
+		{
+			auto & entry = entries[batch_begin + index];
+			auto & data = batch_data[index];
+
+			data.clear();
+			entry.full_size = static_cast<uint32_t>(std::filesystem::file_size(entry.path));
+			entry.compressed_size = 0;
+
+			if(entry.full_size == 0)
+				return;
+
+			memory_file input(entry.path);
+			compress_file(input.ptr(), input.size(), data);
+			entry.compressed_size = static_cast<uint32_t>(data.size());
+
+			// compressed size of 0 marks file that is stored as it is
+			if(options().store_incompressible && data.size() >= input.size())
+			{
+				data.assign(input.ptr(), input.ptr() + input.size());
+				entry.compressed_size = 0;
+			}
+		});
+
+		for(size_t i = batch_begin; i < batch_end; ++i)
+		{
+			const auto & data = batch_data[i - batch_begin];
+
+			assert(offset + data.size() <= UINT32_MAX);
+			entries[i].offset = static_cast<uint32_t>(offset);
+
+			// data of empty files is null
+			if(!data.empty())
+				fwrite(data.data(), 1, data.size(), fp);
+			offset += data.size();
+		}
+	}
+
+	auto write_u32 = [&](size_t position, uint32_t value)
+	{
+		std::copy_n(reinterpret_cast<const uint8_t *>(&value), sizeof(value), header.data() + position);
+	};
+
+	write_u32(0, 0x00444f4c); // "LOD"
+	write_u32(4, 200);
+	write_u32(8, static_cast<uint32_t>(entries.size()));
+
+	for(size_t i = 0; i < entries.size(); ++i)
+	{
+		size_t position = 0x5c + i * 32;
+
+		std::copy(entries[i].name.begin(), entries[i].name.end(), header.data() + position);
+		write_u32(position + 16, entries[i].offset);
+		write_u32(position + 20, entries[i].full_size);
+		write_u32(position + 24, 0);
+		write_u32(position + 28, entries[i].compressed_size);
+	}
+
+	fseek(fp, 0, SEEK_SET);
+	fwrite(header.data(), 1, header.size(), fp);
+	fclose(fp);
+}
@@ -0,0 +1,211 @@
+#include "vcmiextract.h"
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace
+{
+	struct preview_entry
+	{
+		std::filesystem::path path;
+		uint32_t source_width = 0;
+		uint32_t source_height = 0;
+		basic_image_ptr image; // rgba32
+	};
+
+	struct preview_state
+	{
+		std::mutex mutex;
+		std::vector<preview_entry> entries;
+	};
+}
+
+static preview_state & state()
+{
+	static preview_state instance;
+	return instance;
+}
+
+bool vcmiextract::preview_supported(const std::string & filename)
+{
+	std::string extension = std::filesystem::path(filename).extension().string();
+	std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+
+	return extension == ".pcx" || extension == ".p32" || extension == ".def" || extension == ".d32";
+}
+
+// Reads pixel of image as BGRA
+static void read_pixel(const basic_image & image, const uint8_t * pixel, uint8_t * result)
+{
+	switch(image.format)
+	{
+		case basic_image::image_format::p8:
+		{
+			const uint8_t * color = image.palette.get() + 3 * pixel[0];
+			result[0] = color[2];
+			result[1] = color[1];
+			result[2] = color[0];
+			result[3] = image.palette_alpha ? image.palette_alpha[pixel[0]] : 0xff;
+			break;
+		}
+		case basic_image::image_format::g8:
+		case basic_image::image_format::ga16:
+			result[0] = result[1] = result[2] = pixel[0];
+			result[3] = image.format == basic_image::image_format::ga16 ? pixel[1] : 0xff;
+			break;
+		default:
+			result[0] = pixel[0];
+			result[1] = pixel[1];
+			result[2] = pixel[2];
+			result[3] = image.format == basic_image::image_format::rgba32 ? pixel[3] : 0xff;
+			break;
+	}
+}
+
+// Box filter: every pixel of result is average of all source pixels that it covers. Colors are weighted by alpha,
+// so transparent pixels, which often have arbitrary color, do not bleed into visible ones
+static basic_image_ptr downscale(basic_image & image, uint32_t size)
+{
+	uint32_t longest = std::max(image.width, image.height);
+	uint32_t width = longest <= size ? image.width : std::max<uint32_t>(1, uint64_t(image.width) * size / longest);
+	uint32_t height = longest <= size ? image.height : std::max<uint32_t>(1, uint64_t(image.height) * size / longest);
+
+	auto result = std::make_shared<basic_image>(height, width, width * 4, basic_image::image_format::rgba32);
+
+	for(uint32_t row = 0; row < height; ++row)
+	{
+		uint32_t source_top = uint64_t(row) * image.height / height;
+		uint32_t source_bottom = std::max(source_top + 1, uint32_t(uint64_t(row + 1) * image.height / height));
+
+		for(uint32_t col = 0; col < width; ++col)
+		{
+			uint32_t source_left = uint64_t(col) * image.width / width;
+			uint32_t source_right = std::max(source_left + 1, uint32_t(uint64_t(col + 1) * image.width / width));
+
+			uint64_t sum[4] = {};
+
+			for(uint32_t y = source_top; y < source_bottom; ++y)
+			{
+				for(uint32_t x = source_left; x < source_right; ++x)
+				{
+					uint8_t pixel[4];
+					read_pixel(image, image.get_pixel_ptr(x, y), pixel);
+
+					sum[0] += pixel[0] * pixel[3];
+					sum[1] += pixel[1] * pixel[3];
+					sum[2] += pixel[2] * pixel[3];
+					sum[3] += pixel[3];
+				}
+			}
+
+			uint64_t count = uint64_t(source_right - source_left) * (source_bottom - source_top);
+			uint8_t * target = result->get_pixel_ptr(col, row);
+
+			for(int i = 0; i < 3; ++i)
+				target[i] = sum[3] ? sum[i] / sum[3] : 0;
+			target[3] = sum[3] / count;
+		}
+	}
+
+	return result;
+}
+
+// Only downscaled copy of image is kept, so memory use does not depend on size of decoded images
+void vcmiextract::preview_add(const basic_image_ptr & data, const std::filesystem::path & filename)
+{
+	basic_image_ptr source = data;
+	if(source->format == basic_image::image_format::p8)
+		source = expand_special_colors(source);
+
+	preview_entry entry;
+	entry.path = filename;
+	entry.source_width = source->width;
+	entry.source_height = source->height;
+	entry.image = downscale(*source, options().preview_size);
+
+	auto & preview = state();
+
+	std::lock_guard lock(preview.mutex);
+	preview.entries.push_back(entry);
+}
+
+// Previews are placed on pages in order of their names, every preview is centered in its own cell of the grid.
+// Layout of pages is described in preview.json, along with size of original images. Names are relative to parent of destination
+void vcmiextract::preview_write(const std::filesystem::path & destination)
+{
+	constexpr uint32_t columns = 16;
+	constexpr uint32_t rows = 16;
+
+	auto & preview = state();
+
+	std::lock_guard lock(preview.mutex);
+
+	std::sort(preview.entries.begin(), preview.entries.end(), [](const preview_entry & left, const preview_entry & right){
+		return left.path < right.path;
+	});
+
+	if(preview.entries.empty())
+		return;
+
+	uint32_t cell_size = options().preview_size;
+	size_t pages_count = (preview.entries.size() + columns * rows - 1) / (columns * rows);
+
+	std::filesystem::create_directories(destination);
+
+	std::string listing;
+	listing += "{\n";
+	listing += "\t\"pages\" : [ ";
+	for(size_t i = 0; i < pages_count; ++i)
+		listing += (i == 0 ? "\"" : ", \"") + std::string("preview") + std::to_string(i) + ".png\"";
+	listing += " ],\n";
+	listing += "\t\"images\" : [\n";
+
+	std::vector<uint8_t> buffer;
+
+	for(size_t page = 0; page < pages_count; ++page)
+	{
+		size_t first = page * columns * rows;
+		size_t count = std::min<size_t>(preview.entries.size() - first, columns * rows);
+
+		uint32_t page_columns = std::min<size_t>(count, columns);
+		uint32_t page_rows = (count + columns - 1) / columns;
+
+		auto image = std::make_shared<basic_image>(page_rows * cell_size, page_columns * cell_size, page_columns * cell_size * 4, basic_image::image_format::rgba32);
+
+		for(size_t i = 0; i < count; ++i)
+		{
+			const auto & entry = preview.entries[first + i];
+			const auto & source = *entry.image;
+
+			uint32_t x = (i % columns) * cell_size + (cell_size - source.width) / 2;
+			uint32_t y = (i / columns) * cell_size + (cell_size - source.height) / 2;
+
+			for(uint32_t row = 0; row < source.height; ++row)
+				std::memcpy(image->get_pixel_ptr(x, y + row), entry.image->get_pixel_ptr(0, row), source.width * 4);
+
+			listing += "\t\t{ \"name\" : \"" + entry.path.lexically_relative(destination.parent_path()).generic_string() + "\", ";
+			listing += "\"page\" : " + std::to_string(page) + ", ";
+			listing += "\"x\" : " + std::to_string(x) + ", ";
+			listing += "\"y\" : " + std::to_string(y) + ", ";
+			listing += "\"width\" : " + std::to_string(source.width) + ", ";
+			listing += "\"height\" : " + std::to_string(source.height) + ", ";
+			listing += "\"source_width\" : " + std::to_string(entry.source_width) + ", ";
+			listing += "\"source_height\" : " + std::to_string(entry.source_height) + " },\n";
+		}
+
+		buffer.clear();
+		file_format_png::optimize_and_encode(image, buffer, options().png_profile);
+		write_file(destination / ("preview" + std::to_string(page) + ".png"), buffer.data(), buffer.size());
+	}
+
+	listing.pop_back();
+	listing.pop_back();
+	listing += "\n\t]\n}\n";
+
+	write_file(destination / "preview.json", reinterpret_cast<const uint8_t *>(listing.data()), listing.size());
+
+	preview.entries.clear();
+}
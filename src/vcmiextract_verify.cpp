@@ -0,0 +1,114 @@
+#include "vcmiextract.h"
+
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+namespace
+{
+	struct verify_entry
+	{
+		std::filesystem::path path;
+		std::string result;
+	};
+
+	struct verify_state
+	{
+		std::mutex mutex;
+		std::vector<verify_entry> entries;
+		size_t failures = 0;
+	};
+}
+
+static verify_state & state()
+{
+	static verify_state instance;
+	return instance;
+}
+
+static void record(const std::filesystem::path & path, const std::string & result, bool failed)
+{
+	auto & verify = state();
+
+	std::lock_guard lock(verify.mutex);
+	verify.entries.push_back({path, result});
+	if(failed)
+		++verify.failures;
+}
+
+static void record_checksum(const std::filesystem::path & path, uint32_t checksum)
+{
+	char text[16];
+	snprintf(text, sizeof(text), "%08x", checksum);
+	record(path, text, false);
+}
+
+// In verify mode error in one entry is reported and remaining entries are still checked
+void vcmiextract::process_entry(const std::filesystem::path & destination, const std::function<void()> & callback)
+{
+	if(!options().verify)
+	{
+		callback();
+		return;
+	}
+
+	try
+	{
+		callback();
+	}
+	catch(const std::exception & e)
+	{
+		record(destination, std::string("FAILED: ") + e.what(), true);
+	}
+}
+
+// Checksum covers decoded content of image - its dimensions, format, pixels and palette, but not padding of scanlines
+void vcmiextract::verify_image(const basic_image_ptr & data, const std::filesystem::path & filename)
+{
+	uint32_t header[] = { data->width, data->height, static_cast<uint32_t>(data->format) };
+
+	uLong checksum = crc32(0, reinterpret_cast<const Bytef *>(header), sizeof(header));
+
+	for(uint32_t row = 0; row < data->height; ++row)
+		checksum = crc32(checksum, data->get_pixel_ptr(0, row), data->width * data->bytes_per_pixel);
+
+	if(data->format == basic_image::image_format::p8)
+	{
+		checksum = crc32(checksum, data->palette.get(), data->palette_size * 3);
+		if(data->palette_alpha)
+			checksum = crc32(checksum, data->palette_alpha.get(), data->palette_size);
+	}
+
+	record_checksum(filename, checksum);
+}
+
+void vcmiextract::verify_data(const uint8_t * data, size_t size, const std::filesystem::path & filename)
+{
+	record_checksum(filename, crc32_z(0, data, size));
+}
+
+// Prints checksums of all verified files and errors of all failed entries, with paths relative to root, and clears the report.
+// Returns number of failed entries
+size_t vcmiextract::verify_report(const std::filesystem::path & root)
+{
+	auto & verify = state();
+
+	std::lock_guard lock(verify.mutex);
+
+	std::sort(verify.entries.begin(), verify.entries.end(), [](const verify_entry & left, const verify_entry & right){
+		return left.path < right.path;
+	});
+
+	for(const auto & entry : verify.entries)
+		printf("%s: %s\n", entry.path.lexically_relative(root).generic_string().c_str(), entry.result.c_str());
+
+	size_t failures = verify.failures;
+	printf("%zu files verified, %zu failed\n", verify.entries.size() - failures, failures);
+
+	verify.entries.clear();
+	verify.failures = 0;
+	return failures;
+}
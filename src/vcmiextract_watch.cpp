@@ -0,0 +1,259 @@
+#include "vcmiextract.h"
+
+#include "parallel.h"
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+	struct indexed_entry
+	{
+		vcmiextract::archive_index_entry entry;
+		uint32_t hash = 0; // crc32 of data as it is stored in archive
+	};
+
+	struct watched_file
+	{
+		std::filesystem::path source;
+		std::filesystem::path destination;
+		std::map<std::string, indexed_entry> index; // for archives - entries that are currently extracted
+		bool changed = true;
+	};
+}
+
+static std::string get_extension(const std::filesystem::path & path)
+{
+	std::string extension = path.extension().string();
+	std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+	return extension;
+}
+
+// Only archives with directory can be updated entry by entry, other files are extracted again as whole
+static bool has_index(const std::filesystem::path & path)
+{
+	std::string extension = get_extension(path);
+	return extension == ".lod" || extension == ".pac" || extension == ".snd" || extension == ".vid";
+}
+
+// Removes everything that could have been extracted from entry: file itself, converted image or directory of converted animation
+static void remove_entry_outputs(const std::filesystem::path & destination, const std::string & name)
+{
+	std::filesystem::path path = destination / name;
+	std::string extension = get_extension(path);
+	std::error_code error;
+
+	std::filesystem::remove(path, error);
+
+	if(extension == ".pcx" || extension == ".p32")
+		std::filesystem::remove(std::filesystem::path(path).replace_extension(vcmiextract::image_extension()), error);
+
+	if(extension == ".def" || extension == ".d32")
+		std::filesystem::remove_all(destination / path.stem(), error);
+}
+
+// Compares directory of archive with previous one and extracts entries that were added or whose content has changed.
+// Entries that were moved inside archive without changes are not extracted again
+static void update_archive(watched_file & watched, memory_file & file)
+{
+	auto entries = vcmiextract::read_archive_index(file, watched.source);
+
+	std::vector<uint32_t> hashes(entries.size());
+	parallel::for_each_index(entries.size(), [&](size_t index)
+	{
+		memory_file data(file, entries[index].offset, entries[index].size);
+		hashes[index] = crc32_z(0, data.ptr(), data.size());
+	});
+
+	std::map<std::string, indexed_entry> index;
+	std::vector<vcmiextract::archive_index_entry> changed;
+	size_t added = 0;
+	size_t modified = 0;
+	size_t removed = 0;
+
+	for(size_t i = 0; i < entries.size(); ++i)
+	{
+		const auto & entry = entries[i];
+		auto previous = watched.index.find(entry.name);
+
+		if(previous == watched.index.end())
+		{
+			added += 1;
+			changed.push_back(entry);
+		}
+		else if(previous->second.entry.size != entry.size || previous->second.entry.full_size != entry.full_size || previous->second.hash != hashes[i])
+		{
+			modified += 1;
+			remove_entry_outputs(watched.destination, entry.name);
+			changed.push_back(entry);
+		}
+
+		index[entry.name] = { entry, hashes[i] };
+	}
+
+	for(const auto & previous : watched.index)
+	{
+		if(index.count(previous.first))
+			continue;
+
+		removed += 1;
+		remove_entry_outputs(watched.destination, previous.first);
+	}
+
+	vcmiextract::extract_entries(file, changed, watched.destination);
+	watched.index = std::move(index);
+
+	printf("'%s': %zu added, %zu changed, %zu removed", watched.source.filename().string().c_str(), added, modified, removed);
+}
+
+static void update(watched_file & watched)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	if(vcmiextract::options().deferred)
+		vcmiextract::deferred_begin(watched.destination);
+
+	try
+	{
+		if(has_index(watched.source))
+		{
+			memory_file file(watched.source);
+			update_archive(watched, file);
+		}
+		else
+		{
+			vcmiextract::extract_file(watched.source, watched.destination);
+			printf("'%s': extracted", watched.source.filename().string().c_str());
+		}
+
+		printf(" in %.1f ms\n", std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+	}
+	catch(const std::exception & e)
+	{
+		// file may be in the middle of being written, previous index is kept so changes are detected on next write
+		printf("failed to extract '%s': %s\n", watched.source.string().c_str(), e.what());
+	}
+
+	if(vcmiextract::options().deferred)
+		vcmiextract::deferred_end();
+
+	fflush(stdout);
+}
+
+// Files are watched through their directories, since editors and build tools often replace file instead of writing into it.
+// Events that arrive within short time after each other are collected together, so file is extracted once after it was written
+int vcmiextract::run_watch(const std::vector<std::string> & files)
+{
+#ifdef __linux__
+	constexpr int settle_time_ms = 50;
+
+	std::vector<watched_file> watched;
+
+	for(const auto & filename : files)
+	{
+		std::filesystem::path source = std::filesystem::absolute(filename).lexically_normal();
+
+		if(!std::filesystem::is_regular_file(source))
+		{
+			printf("file '%s' not found!\n", filename.c_str());
+			continue;
+		}
+
+		watched_file item;
+		item.source = source;
+		item.destination = source.parent_path() / source.stem();
+		watched.push_back(item);
+	}
+
+	if(watched.empty())
+		return 1;
+
+	int notify = inotify_init1(IN_CLOEXEC);
+	if(notify < 0)
+	{
+		printf("failed to initialize inotify\n");
+		return 1;
+	}
+
+	std::map<int, std::filesystem::path> directories;
+	std::set<std::filesystem::path> watched_directories;
+
+	for(const auto & item : watched)
+	{
+		if(!watched_directories.insert(item.source.parent_path()).second)
+			continue;
+
+		int descriptor = inotify_add_watch(notify, item.source.parent_path().c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+		if(descriptor < 0)
+		{
+			printf("failed to watch directory '%s'\n", item.source.parent_path().string().c_str());
+			return 1;
+		}
+		directories[descriptor] = item.source.parent_path();
+	}
+
+	for(;;)
+	{
+		for(auto & item : watched)
+		{
+			if(item.changed)
+				update(item);
+			item.changed = false;
+		}
+
+		bool has_events = false;
+
+		for(;;)
+		{
+			pollfd request = { notify, POLLIN, 0 };
+			if(poll(&request, 1, has_events ? settle_time_ms : -1) <= 0)
+			{
+				if(has_events)
+					break;
+				continue;
+			}
+
+			alignas(inotify_event) char buffer[4096];
+			ssize_t length = read(notify, buffer, sizeof(buffer));
+			if(length <= 0)
+				continue;
+
+			for(char * pointer = buffer; pointer < buffer + length;)
+			{
+				auto * event = reinterpret_cast<inotify_event *>(pointer);
+				pointer += sizeof(inotify_event) + event->len;
+
+				if(event->len == 0 || !directories.count(event->wd))
+					continue;
+
+				std::filesystem::path path = directories[event->wd] / event->name;
+
+				for(auto & item : watched)
+				{
+					if(item.source == path)
+					{
+						item.changed = true;
+						has_events = true;
+					}
+				}
+			}
+		}
+	}
+#else
+	(void)files;
+	printf("watch mode is not supported on this platform\n");
+	return 1;
+#endif
+}
@@ -23,12 +23,26 @@ void vcmiextract::decompress_file(memory_file & source, memory_file & target)
 	inflate_state->avail_in = source.size();
 	inflate_state->next_in = source.ptr();
 
-	{
-		int ret = inflate(inflate_state, Z_NO_FLUSH);
-		assert(ret == Z_STREAM_END);
-	}
+	int ret = inflate(inflate_state, Z_NO_FLUSH);
+	size_t total_out = inflate_state->total_out;
 
 	inflateEnd(inflate_state);
 
 	delete inflate_state;
+
+	CHECK_FORMAT(ret == Z_STREAM_END);
+	CHECK_FORMAT(total_out == target.size());
+}
+
+void vcmiextract::compress_file(const uint8_t * source, size_t size, std::vector<uint8_t> & target)
+{
+	uLongf compressed_size = compressBound(size);
+	target.resize(compressed_size);
+
+	{
+		[[maybe_unused]] int ret = compress2(target.data(), &compressed_size, source, size, Z_BEST_COMPRESSION);
+		assert(ret == Z_OK);
+	}
+
+	target.resize(compressed_size);
 }